@@ -0,0 +1,185 @@
+/*
+ * bench: timing harness for `make bench`
+ * Author: mtoqeerzafar
+ *
+ * Usage:
+ *   ./bin/bench [-n RUNS] [-a "EXTRA ARGS"] LS_BINARY ROOT
+ *
+ * Runs LS_BINARY in every mode (default columns, -x, -l, -R) over each tree
+ * gen_tree built under ROOT (flat, deep, wide, links; missing ones are
+ * skipped), with stdout going to /dev/null, and prints one row per case:
+ *   - wall time: best and median of RUNS runs (clock_gettime around
+ *     fork/exec/wait4)
+ *   - syscalls: counted in one extra run traced with ptrace, following every
+ *     thread; "n/a" where ptrace is not allowed
+ *   - peak RSS: largest ru_maxrss wait4 reported over the timed runs
+ * EXTRA ARGS (split on spaces) are appended to every command, e.g. "-j 4".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+
+#define MAX_ARGS 64
+#define MAX_RUNS 100
+
+/* ---------- running one command ---------- */
+/* Fork and exec argv with stdout on /dev/null; traced children stop for the
+ * tracer before exec. Returns the pid or -1. */
+static pid_t spawn(char *const argv[], int traced) {
+    pid_t pid = fork();
+    if (pid == -1) { perror("fork"); return -1; }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1) { dup2(fd, STDOUT_FILENO); close(fd); }
+        if (traced) {
+            if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) _exit(126);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* One timed run: wall time in ms, peak RSS in KB; 0 on success */
+static int timed_run(char *const argv[], double *ms, long *rss_kb) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = spawn(argv, 0);
+    if (pid == -1) return -1;
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) { perror("wait4"); return -1; }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    *ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    *rss_kb = ru.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s exited with status %d\n", argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return -1;
+    }
+    return 0;
+}
+
+/* Count system calls of one run (all threads); -1 if it cannot be traced */
+static long count_syscalls(char *const argv[]) {
+    pid_t pid = spawn(argv, 1);
+    if (pid == -1) return -1;
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        /* PTRACE_TRACEME refused: the child exits with 126 */
+        if (WIFSTOPPED(status)) kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    long calls = 0, stops = 0;
+    int have_info = 1, live = 1;
+    while (live > 0) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) { if (errno == EINTR) continue; break; }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) { --live; continue; }
+        if (!WIFSTOPPED(status)) continue;
+
+        int sig = WSTOPSIG(status), deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            /* op (entry/exit) is the first byte of the syscall info */
+            unsigned char info[128];
+            if (have_info && ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info), info) > 0) {
+                if (info[0] == 1) ++calls;
+            } else {
+                have_info = 0;
+                ++stops;
+            }
+        } else if (sig == SIGTRAP && (status >> 16) == PTRACE_EVENT_CLONE) {
+            ++live;
+        } else if (sig == SIGSTOP || sig == SIGTRAP) {
+            /* new thread attach stop or exec trap: nothing to pass on */
+        } else {
+            deliver = sig;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)deliver);
+    }
+    return have_info ? calls : stops / 2;
+}
+
+/* ---------- main ---------- */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    static const char *const trees[] = { "flat", "deep", "wide", "links" };
+    static const char *const modes[] = { "", "-x", "-l", "-R" };
+    int runs = 3;
+    char *extra = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'a': extra = optarg; break;
+            default: runs = 0; break;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS || argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-n RUNS] [-a \"EXTRA ARGS\"] LS_BINARY ROOT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char *ls_bin = argv[optind], *root = argv[optind + 1];
+
+    printf("%-6s %-8s %10s %10s %12s %12s\n", "tree", "mode", "best ms", "median ms", "syscalls", "peak RSS KB");
+    int failed = 0;
+    for (size_t t = 0; t < sizeof(trees) / sizeof(trees[0]); ++t) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", root, trees[t]);
+        struct stat st;
+        if (stat(path, &st) == -1) continue;
+
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+            char *args[MAX_ARGS], *extra_copy = extra ? strdup(extra) : NULL;
+            int n = 0;
+            args[n++] = ls_bin;
+            if (modes[m][0]) args[n++] = (char *)modes[m];
+            for (char *tok = extra_copy ? strtok(extra_copy, " ") : NULL; tok && n < MAX_ARGS - 2; tok = strtok(NULL, " "))
+                args[n++] = tok;
+            args[n++] = path;
+            args[n] = NULL;
+
+            double ms[MAX_RUNS];
+            long rss = 0, r = 0;
+            int ok = 1;
+            for (int i = 0; i < runs && ok; ++i) {
+                ok = timed_run(args, &ms[i], &r) == 0;
+                if (r > rss) rss = r;
+            }
+            if (!ok) { failed = 1; free(extra_copy); continue; }
+            qsort(ms, (size_t)runs, sizeof(ms[0]), cmp_double);
+            long calls = count_syscalls(args);
+
+            char calls_str[32];
+            if (calls < 0) snprintf(calls_str, sizeof(calls_str), "n/a");
+            else snprintf(calls_str, sizeof(calls_str), "%ld", calls);
+            printf("%-6s %-8s %10.1f %10.1f %12s %12ld\n", trees[t], modes[m][0] ? modes[m] : "(cols)",
+                   ms[0], ms[runs / 2], calls_str, rss);
+            fflush(stdout);
+            free(extra_copy);
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,292 @@
+/*
+ * gen_tree: synthetic directory trees for `make bench`
+ * Author: mtoqeerzafar
+ *
+ * Usage:
+ *   ./bin/gen_tree ROOT [flat=N] [deep=D] [wide=F] [links=N]
+ *
+ *   flat=N   ROOT/flat: one directory with N empty files
+ *   deep=D   ROOT/deep: a chain of D nested directories, 4 files per level
+ *   wide=F   ROOT/wide: fan-out F, three levels deep (F + F^2 + F^3
+ *            directories), F files in every leaf
+ *   links=N  ROOT/links: N symlinks, mostly to files in the same directory,
+ *            every tenth one dangling
+ *
+ * A count of 0 removes that tree, so bench does not time a stale one. Each
+ * tree records its parameter in a .params file; a tree that already matches
+ * is left alone, so repeated bench runs do not rebuild a million files. A
+ * tree with other parameters is removed and built again.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* ---------- helpers ---------- */
+static int make_dir(int at_fd, const char *name) {
+    if (mkdirat(at_fd, name, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int make_file(int at_fd, const char *name) {
+    int fd = openat(at_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "create %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int open_dir(int at_fd, const char *name) {
+    int fd = openat(at_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) fprintf(stderr, "open %s: %s\n", name, strerror(errno));
+    return fd;
+}
+
+/* Remove directory name under at_fd with everything in it. Like the
+ * builders it works through fds, one open at a time, so the deep chain is
+ * not cut short by PATH_MAX or the fd limit: descend into the first
+ * subdirectory left, and on the way back up rmdir it from "..". */
+static int rm_tree(int at_fd, const char *name) {
+    int fd = openat(at_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        fprintf(stderr, "open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    char **stack = NULL;
+    size_t depth = 0, cap = 0;
+    int rc = 0;
+    for (;;) {
+        int rfd = dup(fd);
+        DIR *dp = rfd == -1 ? NULL : fdopendir(rfd);
+        if (!dp) { fprintf(stderr, "opendir: %s\n", strerror(errno)); if (rfd != -1) close(rfd); rc = -1; break; }
+        char *sub = NULL;
+        struct dirent *de;
+        while (!sub && (de = readdir(dp)) != NULL) {
+            const char *n = de->d_name;
+            if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) continue;
+            struct stat st;
+            int is_dir = de->d_type == DT_DIR ||
+                         (de->d_type == DT_UNKNOWN && fstatat(fd, n, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+            if (is_dir) sub = strdup(n);
+            else if (unlinkat(fd, n, 0) == -1) { fprintf(stderr, "remove %s: %s\n", n, strerror(errno)); rc = -1; }
+        }
+        closedir(dp);
+        if (rc == -1) { free(sub); break; }
+        if (sub) {
+            if (depth == cap) {
+                size_t ncap = cap ? cap * 2 : 64;
+                char **tmp = realloc(stack, ncap * sizeof(*tmp));
+                if (!tmp) { perror("realloc"); free(sub); rc = -1; break; }
+                stack = tmp;
+                cap = ncap;
+            }
+            int child = openat(fd, sub, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child == -1) {
+                fprintf(stderr, "open %s: %s\n", sub, strerror(errno));
+                free(sub);
+                rc = -1;
+                break;
+            }
+            stack[depth++] = sub;
+            close(fd);
+            fd = child;
+            continue;
+        }
+        /* fd is empty now: back up to its parent and remove it there */
+        if (depth == 0) break;
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = parent;
+        char *done = stack[--depth];
+        if (fd == -1 || unlinkat(fd, done, AT_REMOVEDIR) == -1) {
+            fprintf(stderr, "remove %s: %s\n", done, strerror(errno));
+            free(done);
+            rc = -1;
+            break;
+        }
+        free(done);
+    }
+    if (fd != -1) close(fd);
+    while (depth > 0) free(stack[--depth]);
+    free(stack);
+    if (rc == 0 && unlinkat(at_fd, name, AT_REMOVEDIR) == -1) {
+        fprintf(stderr, "remove %s: %s\n", name, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+/* 1 if ROOT/tree was built with params, otherwise clear it out for a rebuild */
+static int tree_current(const char *root, const char *tree, const char *params) {
+    char path[4096], buf[128] = {0};
+    snprintf(path, sizeof(path), "%s/%s/.params", root, tree);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[n] = '\0';
+        fclose(f);
+        if (strcmp(buf, params) == 0) return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", root, tree);
+    rm_tree(AT_FDCWD, path);
+    return 0;
+}
+
+static void tree_done(const char *root, const char *tree, const char *params) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s/.params", root, tree);
+    FILE *f = fopen(path, "w");
+    if (!f) { fprintf(stderr, "write %s: %s\n", path, strerror(errno)); return; }
+    fputs(params, f);
+    fclose(f);
+}
+
+/* ---------- tree shapes ---------- */
+static int gen_flat(int root_fd, long n) {
+    if (make_dir(root_fd, "flat") == -1) return -1;
+    int fd = open_dir(root_fd, "flat");
+    if (fd == -1) return -1;
+    char name[64];
+    for (long i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "file-%07ld", i);
+        if (make_file(fd, name) == -1) { close(fd); return -1; }
+    }
+    close(fd);
+    return 0;
+}
+
+static int gen_deep(int root_fd, long depth) {
+    if (make_dir(root_fd, "deep") == -1) return -1;
+    int fd = open_dir(root_fd, "deep");
+    char name[64];
+    for (long level = 0; fd != -1 && level < depth; ++level) {
+        for (int i = 0; i < 4; ++i) {
+            snprintf(name, sizeof(name), "f%d", i);
+            if (make_file(fd, name) == -1) { close(fd); return -1; }
+        }
+        /* descend through fds: the chain soon outgrows PATH_MAX */
+        snprintf(name, sizeof(name), "level-%ld", level);
+        int next = make_dir(fd, name) == -1 ? -1 : open_dir(fd, name);
+        close(fd);
+        fd = next;
+    }
+    if (fd == -1) return -1;
+    close(fd);
+    return 0;
+}
+
+static int gen_wide_level(int fd, long fanout, int levels) {
+    char name[64];
+    if (levels == 0) {
+        for (long i = 0; i < fanout; ++i) {
+            snprintf(name, sizeof(name), "file-%ld", i);
+            if (make_file(fd, name) == -1) return -1;
+        }
+        return 0;
+    }
+    for (long i = 0; i < fanout; ++i) {
+        snprintf(name, sizeof(name), "dir-%ld", i);
+        if (make_dir(fd, name) == -1) return -1;
+        int sub = open_dir(fd, name);
+        if (sub == -1) return -1;
+        int rc = gen_wide_level(sub, fanout, levels - 1);
+        close(sub);
+        if (rc == -1) return -1;
+    }
+    return 0;
+}
+
+static int gen_wide(int root_fd, long fanout) {
+    if (make_dir(root_fd, "wide") == -1) return -1;
+    int fd = open_dir(root_fd, "wide");
+    if (fd == -1) return -1;
+    int rc = gen_wide_level(fd, fanout, 3);
+    close(fd);
+    return rc;
+}
+
+static int gen_links(int root_fd, long n) {
+    if (make_dir(root_fd, "links") == -1) return -1;
+    int fd = open_dir(root_fd, "links");
+    if (fd == -1) return -1;
+    long ntargets = n / 10 + 1;
+    char name[64], target[64];
+    for (long i = 0; i < ntargets; ++i) {
+        snprintf(name, sizeof(name), "target-%ld", i);
+        if (make_file(fd, name) == -1) { close(fd); return -1; }
+    }
+    for (long i = 0; i < n; ++i) {
+        if (i % 10 == 9) snprintf(target, sizeof(target), "missing-%ld", i);
+        else snprintf(target, sizeof(target), "target-%ld", i % ntargets);
+        snprintf(name, sizeof(name), "link-%07ld", i);
+        if (symlinkat(target, fd, name) == -1 && errno != EEXIST) {
+            fprintf(stderr, "symlink %s: %s\n", name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/* ---------- main ---------- */
+int main(int argc, char *argv[]) {
+    static const char *const trees[] = { "flat", "deep", "wide", "links" };
+    static int (*const gen[])(int, long) = { gen_flat, gen_deep, gen_wide, gen_links };
+    long count[4] = { 0, 0, 0, 0 };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s ROOT [flat=N] [deep=D] [wide=F] [links=N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 2; i < argc; ++i) {
+        int found = 0;
+        for (int t = 0; t < 4; ++t) {
+            size_t len = strlen(trees[t]);
+            if (strncmp(argv[i], trees[t], len) == 0 && argv[i][len] == '=') {
+                char *end;
+                count[t] = strtol(argv[i] + len + 1, &end, 10);
+                found = *end == '\0' && count[t] >= 0;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s: bad argument '%s'\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *root = argv[1];
+    if (make_dir(AT_FDCWD, root) == -1) return EXIT_FAILURE;
+    int root_fd = open_dir(AT_FDCWD, root);
+    if (root_fd == -1) return EXIT_FAILURE;
+
+    int status = EXIT_SUCCESS;
+    for (int t = 0; t < 4; ++t) {
+        char params[64];
+        snprintf(params, sizeof(params), "%s=%ld\n", trees[t], count[t]);
+        if (count[t] == 0) {
+            if (rm_tree(root_fd, trees[t]) == -1) status = EXIT_FAILURE;
+            continue;
+        }
+        if (tree_current(root, trees[t], params)) continue;
+        printf("gen_tree: building %s/%s (%s=%ld)\n", root, trees[t], trees[t], count[t]);
+        fflush(stdout);
+        if (gen[t](root_fd, count[t]) == -1) { status = EXIT_FAILURE; continue; }
+        tree_done(root, trees[t], params);
+    }
+    close(root_fd);
+    return status;
+}
@@ -0,0 +1,3647 @@
+/*
+ * Programming Assignment 02: ls-v1.7.0
+ * Version 1.7.0 – Single-stat entry table shared by all printers and -R
+ * Author: mtoqeerzafar
+ *
+ * Usage:
+ *   ./bin/ls-v1.7.0            -> default: down-then-across columns
+ *   ./bin/ls-v1.7.0 -l         -> long listing (like ls -l)
+ *   ./bin/ls-v1.7.0 -x         -> horizontal (across-then-down) columns
+ *   ./bin/ls-v1.7.0 -1         -> one name per line
+ *   ./bin/ls-v1.7.0 -U         -> directory order, no sorting; streamed with -1 / -l
+ *   ./bin/ls-v1.7.0 -f         -> like -U, and hidden files are listed too
+ *   ./bin/ls-v1.7.0 -t / -S    -> sort by modification time / size, largest first
+ *   ./bin/ls-v1.7.0 --head K   -> only the first K entries of each directory
+ *   ./bin/ls-v1.7.0 --include=GLOB --exclude=GLOB
+ *                   --include-regex=RE --exclude-regex=RE
+ *                              -> list only matching names / drop matching
+ *                                 names (and, under -R, directories)
+ *   ./bin/ls-v1.7.0 --type=fdlpsbc --size=[+-]N[KMG] --mtime=[+-]N[smhd]
+ *                              -> only these file types / sizes / ages
+ *   ./bin/ls-v1.7.0 -U --chunk[=N]
+ *                              -> columns per block of N entries, printed as read
+ *   ./bin/ls-v1.7.0 --index FILE
+ *                              -> reuse/refresh a metadata index of the tree in FILE
+ *   ./bin/ls-v1.7.0 --watch    -> after the listing, print changes as they happen
+ *   ./bin/ls-v1.7.0 --format=ndjson|binary [--with-names] [--with-time]
+ *                              -> one record per entry for other programs
+ *   ./bin/ls-v1.7.0 --stats    -> report time per phase and counters on stderr
+ *   ./bin/ls-v1.7.0 -R         -> recursive listing, combinable with -l / -x
+ *   ./bin/ls-v1.7.0 -R -j N    -> recursive listing with N worker threads
+ *   ./bin/ls-v1.7.0 --du [-j N] -> disk usage of every directory, like du;
+ *                                 -s prints only the totals of the operands
+ *   ./bin/ls-v1.7.0 --getdents[=SIZE]
+ *                              -> read directories with raw getdents64 batches
+ *                                 of SIZE bytes (default 256K) instead of readdir
+ *   ./bin/ls-v1.7.0 -l --uring -> batch the -l stat calls through io_uring
+ *   ./bin/ls-v1.7.0 --dont-sync
+ *                              -> let NFS/FUSE answer from cached attributes
+ *                                 (statx AT_STATX_DONT_SYNC)
+ *   ./bin/ls-v1.7.0 --parallel-sort=N
+ *                              -> sort directories of N or more entries on all
+ *                                 cores (default 100000, 0 disables)
+ *
+ * Notes:
+ * - Hidden files (starting with '.') are skipped unless -f is given; '.' and
+ *   '..' are never descended into.
+ * - do_ls reads a directory once into a table of struct entry records holding
+ *   the name, the d_type reported by readdir and a lazily filled stat result.
+ *   The printers and the recursion step all read from that table, so every
+ *   entry is stat'ed at most once, and not at all when d_type is enough.
+ * - The walk is built on directory file descriptors (openat, fdopendir,
+ *   *at() calls without following symlinks): entries are stat'ed relative to their
+ *   directory, so no PATH_MAX buffers are joined per entry and deep trees are
+ *   not limited by PATH_MAX. Full paths are only built for -R headers. The
+ *   serial walk keeps at most WALK_FD_DEPTH ancestor fds open, fewer when
+ *   RLIMIT_NOFILE is low; below that a directory's fd is closed while a
+ *   subtree is listed and reopened through ".." (checked by dev/ino), so
+ *   depth is not bounded by RLIMIT_NOFILE.
+ * - With --getdents, names are referenced in place inside the getdents64
+ *   batches, which stay alive until the directory has been printed.
+ * - Entries, names, getdents batches and the sort array of a directory are
+ *   bump-allocated from one arena and released with a single call after the
+ *   directory is printed; under -R the released chunks are reused by the
+ *   next directory, so steady-state listing does almost no malloc/free.
+ * - With -R -j N, worker threads take directories from per-thread
+ *   work-stealing deques and list them concurrently into memory buffers; the
+ *   main thread writes those buffers in the same order as the serial walk.
+ * - Metadata comes from statx asking only for the fields the output needs:
+ *   the file type for -R, type and mode for colour, everything for -l.
+ * - With --uring, -l submits IORING_OP_STATX for a whole directory in
+ *   batches and formats after the completions arrive, overlapping the
+ *   metadata round trips; without io_uring support it quietly falls back to
+ *   one fstatat per entry.
+ * - Owner and group names are looked up once per uid/gid for the whole run
+ *   (shared by all -j workers); ids without a name are cached as well.
+ * - -l timestamps: the date part ("Oct 16 ") is formatted once per local
+ *   day and cached; each entry only renders HH:MM, or the year when the file
+ *   is more than six months old or in the future (the usual ls rule).
+ * - Output goes through a dedicated buffer (struct outbuf): names, colour
+ *   escapes and padding are appended with memcpy and flushed to stdout with
+ *   write(2) in large chunks, with no stdio calls per cell.
+ * - Default and -x listings use one layout pass with GNU-style per-column
+ *   widths, so more names fit on a row; rows carry no trailing blanks.
+ *   Column widths are terminal cells as wcwidth(3) reports them in the
+ *   LC_CTYPE locale, so names with accents, CJK or emoji line up.
+ * - Name lengths, the last '.' (for LS_COLORS suffixes) and whether a name is
+ *   plain ASCII come from one vector pass per name (AVX2 or SSE2, picked at
+ *   startup, with a byte loop elsewhere); only non-ASCII names are decoded.
+ * - Entries are sorted on an inline 8-byte big-endian name prefix stored
+ *   next to each pointer (MSD radix sort for large directories); the full
+ *   names are only compared when two prefixes tie.
+ * - Directories above the --parallel-sort threshold are cut into one run per
+ *   core, each radix-sorted by its own thread, then merged pairwise in
+ *   parallel rounds; the order is exactly that of the serial sort.
+ * - -t and -S stat every entry before sorting (through the ring with
+ *   --uring); ties are broken by name. --head K keeps the best K in a bounded
+ *   max-heap (O(n log K)) and sorts only those; under -R only the listed
+ *   subdirectories are descended into.
+ * - --index FILE serves a directory from a memory-mapped snapshot while its
+ *   own dev/ino/mtime/ctime (and -f/-U) are unchanged; changes to a file's
+ *   metadata alone are not noticed. Uses the serial walk; -f/-U buffer each
+ *   directory instead of streaming it.
+ * - --watch prints a long-format line per change under the listed
+ *   directories: "+" added, "-" removed, "~" written or attributes changed.
+ *   Uses the serial walk.
+ * - --format=ndjson writes one JSON object per entry ({"dir","name","type",
+ *   "ino","mode","nlink","uid","gid","size","blocks","mtime","mtime_ns"});
+ *   --format=binary writes "LSREC01\n" and then length-prefixed little-endian
+ *   records (layout at put_binary_record). Neither looks at colours, user or
+ *   group names or formats times unless --with-names / --with-time ask for
+ *   "user"/"group" and "time". No headers or blank lines; -R just adds
+ *   records. A name that is not valid UTF-8 is written one code point per
+ *   byte (\u0080-\u00ff for the high ones) and flagged by "name_bytes":true
+ *   (likewise "dir_bytes", "user_bytes", ...).
+ * - --stats times readdir, stat, NSS lookups, sort, formatting and write(2)
+ *   with CLOCK_MONOTONIC. Each phase is timed exclusive of the phases nested
+ *   in it, so the time for a lazy stat during -l formatting counts as stat,
+ *   not format. Counters are kept per thread and merged under a lock when a
+ *   -j worker finishes, so under -j the times add up across threads. With
+ *   the flag off each hook is a single branch.
+ * - --du prints "KiB<TAB>path" per directory (with -l "KiB<TAB>bytes<TAB>path",
+ *   bytes being the apparent size) after its subdirectories, counting hidden
+ *   files, the directories themselves and symlinks (not their targets).
+ *   Workers sum each directory's own entries from one statx each; the main
+ *   thread adds the subtrees up while it emits them. Files with more than
+ *   one link are counted once per run, also across operands, where the
+ *   serial walk meets them first: workers only note them, and the main
+ *   thread checks a (dev, ino) hash set as it emits.
+ * - -U/-f with -1 or -l stream: entries are printed in batches of
+ *   STREAM_BATCH (or one getdents64 buffer) as they are read, the batch memory
+ *   is reused and stdout is flushed after each batch, so memory stays flat and
+ *   the first line appears at once. Under -R only subdirectory names are kept.
+ * - --chunk[=N] lays out default and -x listings in blocks of N entries
+ *   (default 4096), each with its own column widths, and writes every
+ *   block before measuring the next. With -U/-f the blocks are streamed as
+ *   the directory is read, so output starts at once and memory stays flat; a
+ *   block also ends where a getdents64 buffer does.
+ * - Filters are applied while reading: excludes before a name is copied or
+ *   stat'ed (an excluded directory is not descended into), the rest stat
+ *   only when --size/--mtime need it. --include, --size and --mtime pass
+ *   directories, as in tree -P; directories hidden by --type are still
+ *   walked under -R. Not combinable with --index.
+ * - Colour is used only when stdout is a terminal. The built-in scheme
+ *   (directories blue, symlinks pink, executables green, .tar/.gz/.zip red,
+ *   devices, fifos and sockets reversed) can be changed through LS_COLORS:
+ *   the type keys fi di ln pi so bd cd ex and "*suffix" entries, parsed once
+ *   into pre-rendered escapes and a suffix hash table. Suffixes match the end
+ *   of regular file names only, the longest one winning.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <locale.h>
+#include <wchar.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* ANSI colours: LS_COLORS-style SGR parameters, sent as "\033[<sgr>m" */
+#define CLR_RESET "\033[0m"
+
+/* File kinds with their own colour, in LS_COLORS key order (color_keys) */
+enum color_kind { CK_FILE, CK_DIR, CK_LINK, CK_FIFO, CK_SOCK, CK_BLK, CK_CHR, CK_EXEC, CK_COUNT };
+
+/* A pre-rendered escape sequence; len 0 leaves the name uncoloured */
+struct color_seq {
+    char *esc;
+    size_t len;
+};
+
+struct color_ext {
+    char *suffix;               /* NULL marks a free slot */
+    size_t len;
+    uint64_t hash;
+    struct color_seq seq;
+};
+
+/* Colour classifier, built once from the defaults and LS_COLORS. "*.ext"
+ * entries with a single dot are hashed on the text from that dot, so a name
+ * needs one lookup on the part after its last '.'; any other "*suffix" (two
+ * dots, none at all) goes to a short list compared from the end. */
+struct color_table {
+    struct color_seq type[CK_COUNT];
+    struct color_ext *ext;      /* open addressing, at most half full */
+    size_t ext_cap, ext_count;
+    struct color_ext *other;
+    size_t nother;
+};
+
+/* One directory entry as collected by do_ls */
+struct entry {
+    char *name;
+    unsigned char d_type;   /* DT_* from readdir, DT_UNKNOWN if the fs did not say */
+    unsigned stat_mask;     /* STATX_* fields of st that are valid */
+    int stat_failed;        /* statx failed once; not retried */
+    struct stat st;
+};
+
+/* statx field sets requested by each kind of output */
+#define META_TYPE  STATX_TYPE
+#define META_COLOR (STATX_TYPE | STATX_MODE)
+#define META_LONG  STATX_BASIC_STATS
+#define META_DU    (STATX_TYPE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS)
+
+/* Raw record layout returned by getdents64(2) */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Bump allocator. Allocations are released in stack order with
+ * arena_mark/arena_release; released chunks go to a free list for reuse. */
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *head;  /* chunk being filled; older chunks follow */
+    struct arena_chunk *free;  /* released chunks kept for reuse */
+    void *last;                /* most recent allocation, can be trimmed */
+};
+
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+/* Everything do_ls collected for one directory; all of it lives in arena */
+struct listing {
+    struct arena *arena;
+    struct entry **list;
+    size_t count, cap;
+    size_t total;           /* entries read, before --head cut count down */
+    struct entry **descend; /* -R: directories hidden by --type, still walked */
+    size_t ndescend;
+    /* streaming: the readers hand the entries read so far to emit() and start
+     * over from mark whenever that is safe for their buffers */
+    void (*emit)(struct listing *ls, void *arg);
+    void *emit_arg;
+    struct arena_mark mark;
+};
+
+#define STREAM_BATCH 4096
+#define WALK_FD_DEPTH 32        /* open ancestor fds before descend detaches */
+#define WALK_FD_RESERVE 16      /* fds kept free of them: stdio, reading, io_uring, inotify */
+#define CHUNK_DEFAULT 4096
+
+/* Output buffer. With an fd it flushes there with write(2) whenever it
+ * fills up; with fd -1 it only grows (per-directory buffers under -j). */
+#define OUTBUF_SIZE (256 * 1024)
+
+struct outbuf {
+    char *buf;
+    size_t len, cap;
+    int fd;
+};
+
+/* The directory being listed: an open fd for *at() calls, its display path
+ * and the buffer its listing is written to */
+struct dir_ctx {
+    int fd;
+    const char *path;
+    struct outbuf *out;
+};
+
+/* --du: a file with more than one link, charged by walk_emit rather than
+ * the worker so the first link in walk order is the one that counts */
+struct du_link {
+    uint64_t dev, ino, blocks, bytes;
+    size_t before;              /* subdirectories listed ahead of it */
+};
+
+/* One directory of the parallel walk. A worker fills out and children; the
+ * main thread emits nodes in serial-walk order once they are done. */
+struct dir_node {
+    struct dir_node *parent;   /* its fd is the openat base; NULL for operands */
+    char *name;                /* name inside parent, or the operand itself */
+    char *path;                /* display path */
+    int fd;
+    atomic_int fd_refs;        /* this node + children that still need openat */
+    struct outbuf out;         /* rendered listing */
+    struct dir_node **children;
+    size_t nchildren;
+    int done;                  /* guarded by walk_pool.lock */
+    int failed;                /* --du: could not even be stat'ed, so no line for it */
+    uint64_t du_blocks, du_bytes; /* --du: this directory, then its whole subtree */
+    struct du_link *links;     /* --du: multiply linked files, in listing order */
+    size_t nlinks, caplinks;
+};
+
+/* Per-worker deque: the owner pushes and pops at the tail, thieves take the
+ * oldest node from the head */
+struct wsdeque {
+    pthread_mutex_t lock;
+    struct dir_node **items;
+    size_t head, tail, cap;
+};
+
+struct walk_pool;
+
+struct worker {
+    struct walk_pool *pool;
+    pthread_t tid;
+    int id;
+    int started;
+    struct wsdeque dq;
+    struct arena arena;
+};
+
+struct walk_pool {
+    int nworkers;
+    struct worker *workers;
+    pthread_mutex_t lock;      /* guards node done flags and shutdown */
+    pthread_cond_t work_cv;    /* idle workers wait here for queued nodes */
+    pthread_cond_t done_cv;    /* the emitting thread waits here for nodes */
+    atomic_long queued;        /* nodes sitting in deques */
+    int shutdown;
+};
+
+enum dir_backend { BACKEND_READDIR, BACKEND_GETDENTS };
+
+#define GETDENTS_DEFAULT_BUF (256 * 1024)
+#define GETDENTS_MIN_BUF     4096
+
+enum sort_key { SORT_NAME, SORT_TIME, SORT_SIZE };
+
+/* On-disk index (--index): header, then per-directory entry arrays and
+ * names, then the directory table sorted by (hash, path). All offsets are
+ * from the start of the file; everything is native-endian and 8-aligned. */
+#define INDEX_MAGIC   "LSINDEX"
+#define INDEX_VERSION 3
+#define IDX_ALL       1u    /* idx_dir flags: hidden entries were read (-f) */
+#define IDX_UNSORTED  2u    /* entries are in directory order (-U/-f) */
+
+struct idx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ndirs;
+    uint64_t dirs_off;
+    uint64_t file_size;
+};
+
+struct idx_dir {
+    uint64_t hash;              /* FNV-1a of the display path */
+    uint64_t dev, ino;
+    int64_t mtime, ctime;
+    uint32_t mtime_ns, ctime_ns;
+    uint64_t path_off, ent_off, names_off;
+    uint32_t path_len, nent;
+    uint32_t names_len, flags;  /* IDX_* options the entries were read under */
+    uint64_t sum;               /* FNV-1a over the entry array and the names */
+};
+
+struct idx_ent {
+    uint64_t ino, size, blocks, dev, rdev;
+    int64_t atime, mtime, ctime;
+    uint32_t atime_ns, mtime_ns, ctime_ns;
+    uint32_t mode, nlink, uid, gid;
+    uint32_t name_off, stat_mask;
+    uint16_t name_len;
+    uint8_t d_type, stat_failed;
+    uint32_t pad;
+};
+
+/* The index read at startup and the one being built for this run */
+struct meta_index {
+    const char *path;
+    const char *map;
+    size_t map_len;
+    const struct idx_dir *dirs;
+    uint32_t ndirs;
+    struct outbuf body;         /* entries, names and paths of the new index */
+    struct idx_dir *new_dirs;
+    size_t new_count, new_cap;
+    int dirty;                  /* the new index differs from the mapped one */
+};
+
+enum out_format { OUT_TEXT, OUT_NDJSON, OUT_BINARY };
+
+#define BINARY_MAGIC "LSREC01\n"
+#define REC_STAT  1u     /* record flags: stat fields are valid */
+#define REC_NAMES 2u     /* user and group names follow */
+#define REC_TIME  4u     /* formatted time follows */
+
+/* --stats: phases of a run, timed exclusively of each other */
+enum stat_phase { PH_READDIR, PH_STAT, PH_NSS, PH_SORT, PH_FORMAT, PH_WRITE, PH_COUNT };
+
+struct run_stats {
+    uint64_t ns[PH_COUNT];
+    uint64_t calls[PH_COUNT];
+    uint64_t dirs, entries, bytes;
+    uint64_t inner;             /* time of every phase ended so far (nesting) */
+};
+
+struct stats_span {
+    uint64_t t0, inner0;
+};
+
+/* --du: (dev, ino) of every multiply linked file counted so far, so each is
+ * summed once. Only the emitting thread uses it, in serial walk order. */
+struct inode_key {
+    uint64_t dev, ino;          /* ino 0 marks a free slot */
+};
+
+struct inode_set {
+    struct inode_key *slots;    /* open addressing, at most half full */
+    size_t cap, count;
+};
+
+/* --include/--exclude pattern: a glob, or an extended regex when glob is NULL */
+struct name_pattern {
+    const char *glob;
+    regex_t re;
+};
+
+/* Type bit of an S_IFMT value in filter_set.types */
+#define FILTER_TYPE_BIT(mode) (1u << (((mode) & S_IFMT) >> 12))
+
+/* Entry filters from the command line. Excludes are tested on every name as
+ * it is read; everything else is settled by filter_listing afterwards. */
+struct filter_set {
+    struct name_pattern *include, *exclude;
+    size_t ninclude, nexclude;
+    unsigned types;             /* FILTER_TYPE_BIT of each --type letter, 0 = any */
+    char size_cmp, mtime_cmp;   /* '+', '-' or '=' (size only); 0 = no test */
+    off_t size;
+    time_t age;                 /* seconds before opts.now */
+    int active;                 /* any filter given */
+    int post;                   /* a test filter_listing has to run */
+};
+
+enum filter_verdict { FILTER_DROP, FILTER_SHOW, FILTER_DESCEND };
+
+/* Command line options, filled once in main */
+struct ls_options {
+    int long_format;
+    int horizontal;
+    int one_per_line;
+    int unsorted;
+    enum sort_key sort_by;
+    size_t head;            /* --head K, 0 = everything */
+    size_t chunk;           /* --chunk N: column layout per N entries, 0 = per directory */
+    const char *index_path; /* --index FILE */
+    int watch;
+    enum out_format format;
+    int with_names, with_time; /* what --format records include on top of stat */
+    int stats;
+    int du, du_summary;     /* --du, -s: sizes of whole subtrees instead of listings */
+    int all;
+    int recursive;
+    int color;
+    int jobs;
+    int term_width;
+    time_t now;             /* reference time for the six-month rule */
+    long tz_offset;         /* UTC offset at startup, used to bucket days */
+    enum dir_backend backend;
+    size_t getdents_bufsize;
+    int uring;
+    int statx_sync;         /* AT_STATX_SYNC_AS_STAT or AT_STATX_DONT_SYNC */
+    size_t sort_parallel_min; /* entries needed for the parallel sort, 0 = off */
+    int ncpus;
+};
+
+#define SORT_PARALLEL_DEFAULT 100000
+#define SORT_MAX_THREADS      64
+
+enum { OPT_GETDENTS = 256, OPT_URING, OPT_DONT_SYNC, OPT_PARALLEL_SORT, OPT_HEAD, OPT_INDEX, OPT_WATCH, OPT_FORMAT, OPT_WITH_NAMES, OPT_WITH_TIME, OPT_STATS, OPT_DU, OPT_CHUNK, OPT_INCLUDE, OPT_EXCLUDE, OPT_INCLUDE_REGEX, OPT_EXCLUDE_REGEX, OPT_TYPE, OPT_SIZE, OPT_MTIME };
+
+static const struct option long_options[] = {
+    { "getdents", optional_argument, NULL, OPT_GETDENTS },
+    { "uring", no_argument, NULL, OPT_URING },
+    { "dont-sync", no_argument, NULL, OPT_DONT_SYNC },
+    { "parallel-sort", required_argument, NULL, OPT_PARALLEL_SORT },
+    { "head", required_argument, NULL, OPT_HEAD },
+    { "index", required_argument, NULL, OPT_INDEX },
+    { "watch", no_argument, NULL, OPT_WATCH },
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { "with-names", no_argument, NULL, OPT_WITH_NAMES },
+    { "with-time", no_argument, NULL, OPT_WITH_TIME },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "du", no_argument, NULL, OPT_DU },
+    { "chunk", optional_argument, NULL, OPT_CHUNK },
+    { "include", required_argument, NULL, OPT_INCLUDE },
+    { "exclude", required_argument, NULL, OPT_EXCLUDE },
+    { "include-regex", required_argument, NULL, OPT_INCLUDE_REGEX },
+    { "exclude-regex", required_argument, NULL, OPT_EXCLUDE_REGEX },
+    { "type", required_argument, NULL, OPT_TYPE },
+    { "size", required_argument, NULL, OPT_SIZE },
+    { "mtime", required_argument, NULL, OPT_MTIME },
+    { NULL, 0, NULL, 0 }
+};
+
+#ifdef HAVE_IO_URING
+#define STAT_RING_ENTRIES 256
+
+/* Per-thread io_uring used to batch statx calls for -l */
+struct stat_ring {
+    int state;                  /* 0 = not tried yet, 1 = ready, -1 = unavailable */
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    struct statx bufs[STAT_RING_ENTRIES];
+};
+#endif
+
+#define NAME_CACHE_BUCKETS 256
+
+/* uid -> user name or gid -> group name; name is NULL when NSS has none */
+struct name_cache_ent {
+    struct name_cache_ent *next;
+    unsigned id;
+    char *name;
+};
+
+struct name_cache {
+    pthread_mutex_t lock;
+    int is_group;
+    struct name_cache_ent *buckets[NAME_CACHE_BUCKETS];
+};
+
+#define TIME_CACHE_SLOTS 64
+#define SIX_MONTHS (31556952 / 2)   /* half a Gregorian year, in seconds */
+
+/* One local calendar day [start, end) in epoch seconds with its formatted
+ * "Mon dd " prefix and year; uniform = no UTC offset change inside the day */
+struct day_slot {
+    time_t start, end;
+    int valid, uniform;
+    char prefix[16];
+    char year[16];
+};
+
+static struct ls_options opts;
+static struct arena walk_arena;
+static struct outbuf out_stdout = { NULL, 0, 0, STDOUT_FILENO };
+static struct meta_index meta_index = { .body = { NULL, 0, 0, -1 } };
+static _Thread_local struct run_stats tl_stats;
+static struct run_stats run_stats;
+static pthread_mutex_t run_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode_set du_links;
+static struct color_table colors;
+static struct filter_set filters;
+static int walk_depth;          /* ancestor fds the serial walk holds open */
+static int walk_fd_cap;         /* how many it may hold, see walk_fd_init */
+static struct name_cache user_cache = { PTHREAD_MUTEX_INITIALIZER, 0, { NULL } };
+static struct name_cache group_cache = { PTHREAD_MUTEX_INITIALIZER, 1, { NULL } };
+
+/* Prototypes */
+void do_ls(int at_fd, const char *name, const char *path);
+void do_ls_parallel(const char *path);
+static int list_dir(int fd, const char *path);
+static int descend(int fd, const char *name, const char *path);
+void print_long_format(const struct dir_ctx *dir, struct entry *e);
+void print_columns(struct entry **list, size_t count, int term_width, const struct dir_ctx *dir);
+void print_horizontal(struct entry **list, size_t count, int term_width, const struct dir_ctx *dir);
+void color_print_name(const struct dir_ctx *dir, struct entry *e);
+static int entry_cmp(const void *a, const void *b);
+static void sort_entries(struct entry **list, size_t count);
+static void order_listing(const struct dir_ctx *dir, struct listing *ls);
+static int parse_size(const char *arg, size_t *out);
+static void ob_write(struct outbuf *ob, const void *p, size_t n);
+static void ob_puts(struct outbuf *ob, const char *s);
+static void ob_putc(struct outbuf *ob, char c);
+static void ob_pad(struct outbuf *ob, size_t n);
+static void ob_num(struct outbuf *ob, long long v, int width);
+static void ob_printf(struct outbuf *ob, const char *fmt, ...);
+static void ob_flush(struct outbuf *ob);
+static void *arena_alloc(struct arena *a, size_t size);
+static void arena_trim(struct arena *a, void *p, size_t size);
+static struct arena_mark arena_mark(struct arena *a);
+static void arena_release(struct arena *a, struct arena_mark m);
+static void arena_destroy(struct arena *a);
+static int listing_add(struct listing *ls, const char *name, size_t len, unsigned char d_type, int copy);
+static int read_dir_readdir(int fd, const char *path, struct listing *ls);
+static int read_dir_getdents(int fd, const char *path, struct listing *ls);
+static void listing_emit(struct listing *ls);
+static int read_listing(const struct dir_ctx *dir, struct listing *ls);
+static void print_listing(const struct dir_ctx *dir, struct listing *ls);
+static void print_records(const struct dir_ctx *dir, struct listing *ls);
+static void print_separator(struct outbuf *ob);
+static void stat_ring_fill(const struct dir_ctx *dir, struct listing *ls);
+static void stat_ring_teardown(void);
+static const char *cached_name(struct name_cache *c, unsigned id);
+static void name_cache_free(struct name_cache *c);
+static size_t format_mtime(time_t t, char *buf, size_t bufsz);
+static int get_terminal_width(void);
+static void index_open(const char *path);
+static const struct idx_dir *index_lookup(const char *path, const struct stat *dst);
+static size_t index_load(const struct idx_dir *d, struct listing *ls);
+static void index_record(const char *path, const struct stat *dst, struct entry **list, size_t n, size_t nostat);
+static void index_write(void);
+static void index_close(void);
+static int watch_init(void);
+static void watch_add(const char *path);
+static void watch_loop(void);
+static char *join_path(const char *dir, const char *name);
+static uint64_t stats_clock(void);
+static struct stats_span stats_begin(void);
+static void stats_end(enum stat_phase ph, struct stats_span s);
+static void stats_merge(void);
+static void stats_report(uint64_t wall_ns);
+static void du_free(void);
+static void color_init(const char *ls_colors);
+static void scan_init(void);
+static void walk_fd_init(void);
+static void color_free(void);
+static struct stat *entry_stat(const struct dir_ctx *dir, struct entry *e, unsigned want);
+static void statx_to_stat(const struct statx *sx, struct stat *st);
+static mode_t entry_type(const struct dir_ctx *dir, struct entry *e);
+static mode_t dtype_mode(unsigned char d_type);
+static int filter_add_pattern(const char *arg, int exclude, int regex);
+static int filter_parse_types(const char *arg);
+static int filter_parse_size(const char *arg);
+static int filter_parse_age(const char *arg);
+static int filter_name(const char *name, unsigned char d_type);
+static void filter_listing(const struct dir_ctx *dir, struct listing *ls);
+static void filter_free(void);
+
+/* ---------- main ---------- */
+int main(int argc, char *argv[]) {
+    int opt;
+
+    opts.getdents_bufsize = GETDENTS_DEFAULT_BUF;
+    opts.jobs = 1;
+    opts.sort_parallel_min = SORT_PARALLEL_DEFAULT;
+    uint64_t start = stats_clock();
+    while ((opt = getopt_long(argc, argv, "lx1UftSRsj:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': opts.long_format = 1; break;
+            case 'x': opts.horizontal = 1; break;
+            case '1': opts.one_per_line = 1; break;
+            case 'U': opts.unsorted = 1; break;
+            case 'f': opts.unsorted = 1; opts.all = 1; break;
+            case 't': opts.sort_by = SORT_TIME; break;
+            case 'S': opts.sort_by = SORT_SIZE; break;
+            case 'R': opts.recursive = 1; break;
+            case 's': opts.du = 1; opts.du_summary = 1; break;
+            case 'j':
+                opts.jobs = atoi(optarg);
+                if (opts.jobs < 1) {
+                    fprintf(stderr, "%s: invalid job count '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_GETDENTS:
+                opts.backend = BACKEND_GETDENTS;
+                if (optarg && parse_size(optarg, &opts.getdents_bufsize) == -1) {
+                    fprintf(stderr, "%s: invalid getdents buffer size '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                if (opts.getdents_bufsize < GETDENTS_MIN_BUF) opts.getdents_bufsize = GETDENTS_MIN_BUF;
+                break;
+            case OPT_URING: opts.uring = 1; break;
+            case OPT_DONT_SYNC: opts.statx_sync = AT_STATX_DONT_SYNC; break;
+            case OPT_PARALLEL_SORT:
+                if (parse_size(optarg, &opts.sort_parallel_min) == -1) {
+                    fprintf(stderr, "%s: invalid parallel sort threshold '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_HEAD:
+                if (parse_size(optarg, &opts.head) == -1 || opts.head == 0) {
+                    fprintf(stderr, "%s: invalid entry count '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_INDEX: opts.index_path = optarg; break;
+            case OPT_WATCH: opts.watch = 1; break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "ndjson") == 0) opts.format = OUT_NDJSON;
+                else if (strcmp(optarg, "binary") == 0) opts.format = OUT_BINARY;
+                else if (strcmp(optarg, "text") == 0) opts.format = OUT_TEXT;
+                else {
+                    fprintf(stderr, "%s: unknown format '%s' (text, ndjson, binary)\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_WITH_NAMES: opts.with_names = 1; break;
+            case OPT_WITH_TIME: opts.with_time = 1; break;
+            case OPT_STATS: opts.stats = 1; break;
+            case OPT_DU: opts.du = 1; break;
+            case OPT_CHUNK:
+                opts.chunk = CHUNK_DEFAULT;
+                if (optarg && (parse_size(optarg, &opts.chunk) == -1 || opts.chunk == 0)) {
+                    fprintf(stderr, "%s: invalid chunk size '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_INCLUDE:
+            case OPT_EXCLUDE:
+            case OPT_INCLUDE_REGEX:
+            case OPT_EXCLUDE_REGEX:
+                if (filter_add_pattern(optarg, opt == OPT_EXCLUDE || opt == OPT_EXCLUDE_REGEX,
+                                       opt == OPT_INCLUDE_REGEX || opt == OPT_EXCLUDE_REGEX) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case OPT_TYPE:
+                if (filter_parse_types(optarg) == -1) {
+                    fprintf(stderr, "%s: invalid file types '%s' (letters f d l p s b c)\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SIZE:
+                if (filter_parse_size(optarg) == -1) {
+                    fprintf(stderr, "%s: invalid size test '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_MTIME:
+                if (filter_parse_age(optarg) == -1) {
+                    fprintf(stderr, "%s: invalid age test '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-x] [-1] [-U] [-f] [-t] [-S] [-R] [-s] [-j N] [--head K] [--chunk[=N]] [--include=GLOB] [--exclude=GLOB] [--include-regex=RE] [--exclude-regex=RE] [--type=TYPES] [--size=[+-]N] [--mtime=[+-]N] [--du] [--index FILE] [--watch] [--format=FMT] [--with-names] [--with-time] [--stats] [--getdents[=SIZE]] [--uring] [--dont-sync] [--parallel-sort=N] [directory...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    /* -l takes precedence */
+    if (opts.long_format) opts.horizontal = 0;
+    if (opts.long_format || opts.horizontal) opts.one_per_line = 0;
+    opts.color = isatty(STDOUT_FILENO) && opts.format == OUT_TEXT;
+    /* only the character classes: name widths follow the user's encoding */
+    setlocale(LC_CTYPE, "");
+    scan_init();
+    walk_fd_init();
+    if (opts.color) color_init(getenv("LS_COLORS"));
+    opts.term_width = get_terminal_width();
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.ncpus = ncpus < 1 ? 1 : ncpus > SORT_MAX_THREADS ? SORT_MAX_THREADS : (int)ncpus;
+    tzset();
+    opts.now = time(NULL);
+    struct tm now_tm;
+    opts.tz_offset = localtime_r(&opts.now, &now_tm) ? now_tm.tm_gmtoff : 0;
+    if (opts.du) {
+        if (opts.index_path || opts.watch || opts.format != OUT_TEXT) {
+            fprintf(stderr, "%s: --du/-s cannot be combined with --index, --watch or --format\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        /* sizes cover the whole tree: hidden files and every entry count */
+        opts.recursive = 1;
+        opts.all = 1;
+        opts.head = 0;
+    }
+    filters.post = filters.ninclude || filters.types || filters.size_cmp || filters.mtime_cmp;
+    filters.active = filters.post || filters.nexclude;
+    if (filters.active && opts.index_path) {
+        fprintf(stderr, "%s: --index cannot be combined with filters\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int parallel = (opts.recursive && opts.jobs > 1 && !opts.index_path && !opts.watch) || opts.du;
+    if (opts.watch && watch_init() == -1) return EXIT_FAILURE;
+    if (opts.format == OUT_BINARY) ob_write(&out_stdout, BINARY_MAGIC, 8);
+    if (opts.index_path) index_open(opts.index_path);
+
+    if (optind == argc) {
+        if (parallel) do_ls_parallel(".");
+        else do_ls(AT_FDCWD, ".", ".");
+    } else {
+        for (int i = optind; i < argc; ++i) {
+            if (argc - optind > 1 && !opts.recursive && opts.format == OUT_TEXT && !opts.du)
+                ob_printf(&out_stdout, "%s:\n", argv[i]);
+            if (parallel) do_ls_parallel(argv[i]);
+            else do_ls(AT_FDCWD, argv[i], argv[i]);
+            if (i + 1 < argc) print_separator(&out_stdout);
+        }
+    }
+    if (opts.index_path) { index_write(); index_close(); }
+    if (opts.watch) watch_loop();
+    ob_flush(&out_stdout);
+    free(out_stdout.buf);
+    if (opts.stats) { stats_merge(); stats_report(stats_clock() - start); }
+    arena_destroy(&walk_arena);
+    stat_ring_teardown();
+    name_cache_free(&user_cache);
+    name_cache_free(&group_cache);
+    if (opts.du) du_free();
+    color_free();
+    filter_free();
+    return 0;
+}
+
+/* ---------- run statistics (--stats) ---------- */
+static uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct stats_span stats_begin(void) {
+    struct stats_span s = { 0, 0 };
+    if (opts.stats) { s.t0 = stats_clock(); s.inner0 = tl_stats.inner; }
+    return s;
+}
+
+/* Charge the span to ph, minus whatever nested phases already took */
+static void stats_end(enum stat_phase ph, struct stats_span s) {
+    if (!opts.stats) return;
+    uint64_t dur = stats_clock() - s.t0;
+    uint64_t nested = tl_stats.inner - s.inner0;
+    tl_stats.ns[ph] += dur > nested ? dur - nested : 0;
+    tl_stats.calls[ph]++;
+    tl_stats.inner = s.inner0 + dur;
+}
+
+/* Fold this thread's counters into the run totals */
+static void stats_merge(void) {
+    if (!opts.stats) return;
+    pthread_mutex_lock(&run_stats_lock);
+    for (int i = 0; i < PH_COUNT; ++i) {
+        run_stats.ns[i] += tl_stats.ns[i];
+        run_stats.calls[i] += tl_stats.calls[i];
+    }
+    run_stats.dirs += tl_stats.dirs;
+    run_stats.entries += tl_stats.entries;
+    run_stats.bytes += tl_stats.bytes;
+    pthread_mutex_unlock(&run_stats_lock);
+    memset(&tl_stats, 0, sizeof(tl_stats));
+}
+
+static void stats_report(uint64_t wall_ns) {
+    static const char *const names[PH_COUNT] = { "readdir", "stat", "nss", "sort", "format", "write" };
+    uint64_t sum = 0;
+    for (int i = 0; i < PH_COUNT; ++i) sum += run_stats.ns[i];
+    fprintf(stderr, "--stats: wall %.3f ms, phases %.3f ms%s\n", (double)wall_ns / 1e6, (double)sum / 1e6,
+            opts.jobs > 1 && opts.recursive ? " (summed over threads)" : "");
+    fprintf(stderr, "  %-8s %12s %12s %6s\n", "phase", "calls", "ms", "%");
+    for (int i = 0; i < PH_COUNT; ++i)
+        fprintf(stderr, "  %-8s %12llu %12.3f %6.1f\n", names[i], (unsigned long long)run_stats.calls[i],
+                (double)run_stats.ns[i] / 1e6, sum ? 100.0 * (double)run_stats.ns[i] / (double)sum : 0.0);
+    fprintf(stderr, "  directories %llu, entries %llu, bytes written %llu\n",
+            (unsigned long long)run_stats.dirs, (unsigned long long)run_stats.entries,
+            (unsigned long long)run_stats.bytes);
+}
+
+/* ---------- helpers ---------- */
+/* Display path of name inside dir, heap allocated so depth is not capped by PATH_MAX */
+static char *join_path(const char *dir, const char *name) {
+    char *out = NULL;
+    int rc;
+    if (!dir || dir[0] == '\0' || (dir[0]=='.' && dir[1]=='\0'))
+        rc = asprintf(&out, "%s", name);
+    else {
+        size_t len = strlen(dir);
+        if (dir[len-1] == '/') rc = asprintf(&out, "%s%s", dir, name);
+        else rc = asprintf(&out, "%s/%s", dir, name);
+    }
+    return rc < 0 ? NULL : out;
+}
+
+static int get_terminal_width(void) {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) return (int)w.ws_col;
+    return 80;
+}
+
+/* Parse a byte count with an optional K/M/G suffix; digits first, so no
+ * sign or blanks (strtoull would quietly wrap "-1" to the maximum) */
+static int parse_size(const char *arg, size_t *out) {
+    if (*arg < '0' || *arg > '9') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno) return -1;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: break;
+    }
+    if (*end != '\0' || v > (SIZE_MAX >> shift)) return -1;
+    *out = (size_t)v << shift;
+    return 0;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct entry *const *pa = a;
+    const struct entry *const *pb = b;
+    return strcmp((*pa)->name, (*pb)->name);
+}
+
+/* Metadata layer: statx the entry (relative to its directory fd, without
+ * following symlinks) asking only for the fields in want. Fields fetched
+ * earlier are served from the entry; NULL on error. */
+static struct stat *entry_stat(const struct dir_ctx *dir, struct entry *e, unsigned want) {
+    if (e->stat_failed) return NULL;
+    if ((e->stat_mask & want) != want) {
+        struct statx sx;
+        struct stats_span span = stats_begin();
+        int rc = statx(dir->fd, e->name, AT_SYMLINK_NOFOLLOW | opts.statx_sync, want, &sx);
+        stats_end(PH_STAT, span);
+        if (rc == -1) {
+            fprintf(stderr, "statx %s/%s: %s\n", dir->path, e->name, strerror(errno));
+            e->stat_failed = 1;
+            return NULL;
+        }
+        statx_to_stat(&sx, &e->st);
+        /* a field the fs cannot supply is not asked for again */
+        e->stat_mask = sx.stx_mask | want;
+    }
+    return &e->st;
+}
+
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = (off_t)sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = (blkcnt_t)sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec; st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec; st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec; st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* File type bits (S_IFMT part of st_mode), taken from d_type when the fs provided it */
+static mode_t entry_type(const struct dir_ctx *dir, struct entry *e) {
+    mode_t type = dtype_mode(e->d_type);
+    if (type) return type;
+    struct stat *st = entry_stat(dir, e, META_TYPE);
+    return st ? (st->st_mode & S_IFMT) : 0;
+}
+
+/* ---------- arena allocator ---------- */
+static void *arena_alloc(struct arena *a, size_t size) {
+    /* rounding up (and the chunk header) must not wrap around */
+    if (size > SIZE_MAX - sizeof(struct arena_chunk) - ARENA_ALIGN) { errno = ENOMEM; return NULL; }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *c = a->head;
+    if (!c || c->size - c->used < size) {
+        /* reuse a released chunk if one is big enough, else get a new one */
+        struct arena_chunk **pp = &a->free;
+        while (*pp && (*pp)->size < size) pp = &(*pp)->next;
+        if (*pp) {
+            c = *pp;
+            *pp = c->next;
+        } else {
+            size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+            c = malloc(sizeof(*c) + csize);
+            if (!c) return NULL;
+            c->size = csize;
+        }
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    a->last = p;
+    return p;
+}
+
+/* Shrink the most recent allocation p to size bytes */
+static void arena_trim(struct arena *a, void *p, size_t size) {
+    if (!a->head || p != a->last) return;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->head->used = (size_t)((char *)p - a->head->data) + size;
+}
+
+static struct arena_mark arena_mark(struct arena *a) {
+    struct arena_mark m = { a->head, a->head ? a->head->used : 0 };
+    return m;
+}
+
+/* Drop everything allocated since m; whole chunks go to the free list */
+static void arena_release(struct arena *a, struct arena_mark m) {
+    while (a->head && a->head != m.chunk) {
+        struct arena_chunk *c = a->head;
+        a->head = c->next;
+        c->next = a->free;
+        a->free = c;
+    }
+    if (a->head) a->head->used = m.used;
+    a->last = NULL;
+}
+
+static void arena_destroy(struct arena *a) {
+    struct arena_chunk *lists[2] = { a->head, a->free };
+    for (int i = 0; i < 2; ++i) {
+        while (lists[i]) {
+            struct arena_chunk *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+    a->head = a->free = NULL;
+    a->last = NULL;
+}
+
+/* ---------- buffered output ---------- */
+static const char spaces[64] = "                                                                ";
+
+/* Write everything buffered to ob->fd; memory-only buffers keep their data */
+static void ob_flush(struct outbuf *ob) {
+    if (ob->fd == -1) return;
+    struct stats_span span = stats_begin();
+    tl_stats.bytes += ob->len;
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t w = write(ob->fd, ob->buf + off, ob->len - off);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        off += (size_t)w;
+    }
+    ob->len = 0;
+    stats_end(PH_WRITE, span);
+}
+
+/* Make room for n more bytes; 0 on success */
+static int ob_reserve(struct outbuf *ob, size_t n) {
+    if (ob->cap - ob->len >= n) return 0;
+    if (ob->fd != -1 && ob->len) {
+        ob_flush(ob);
+        if (ob->cap >= n) return 0;
+    }
+    size_t ncap = ob->cap ? ob->cap : (ob->fd != -1 ? OUTBUF_SIZE : 4096);
+    while (ncap - ob->len < n) ncap *= 2;
+    char *tmp = realloc(ob->buf, ncap);
+    if (!tmp) { perror("realloc"); return -1; }
+    ob->buf = tmp;
+    ob->cap = ncap;
+    return 0;
+}
+
+static void ob_write(struct outbuf *ob, const void *p, size_t n) {
+    if (n == 0) return;   /* p may be NULL then (absent user/group name) */
+    /* a block bigger than the buffer goes straight out once it is empty */
+    if (ob->fd != -1 && n >= OUTBUF_SIZE) {
+        ob_flush(ob);
+        struct outbuf direct = { (char *)p, n, n, ob->fd };
+        ob_flush(&direct);
+        return;
+    }
+    if (ob_reserve(ob, n) == -1) return;
+    memcpy(ob->buf + ob->len, p, n);
+    ob->len += n;
+}
+
+static void ob_puts(struct outbuf *ob, const char *s) {
+    ob_write(ob, s, strlen(s));
+}
+
+static void ob_putc(struct outbuf *ob, char c) {
+    if (ob->len == ob->cap && ob_reserve(ob, 1) == -1) return;
+    ob->buf[ob->len++] = c;
+}
+
+/* n spaces, copied from a fixed run of blanks */
+static void ob_pad(struct outbuf *ob, size_t n) {
+    while (n > 0) {
+        size_t k = n < sizeof(spaces) ? n : sizeof(spaces);
+        ob_write(ob, spaces, k);
+        n -= k;
+    }
+}
+
+/* Decimal v right-aligned in width columns (like %*lld) */
+static void ob_num(struct outbuf *ob, long long v, int width) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    do { *--p = (char)('0' + u % 10); u /= 10; } while (u);
+    if (v < 0) *--p = '-';
+    size_t n = (size_t)(tmp + sizeof(tmp) - p);
+    if ((size_t)width > n) ob_pad(ob, (size_t)width - n);
+    ob_write(ob, p, n);
+}
+
+/* Fallback for the rare formatted line (headers); not used per entry */
+static void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || ob_reserve(ob, (size_t)n + 1) == -1) return;
+    va_start(ap, fmt);
+    vsnprintf(ob->buf + ob->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    ob->len += (size_t)n;
+}
+
+/* ---------- entry filters (--include/--exclude, --type, --size, --mtime) ---------- */
+static int filter_add_pattern(const char *arg, int exclude, int regex) {
+    struct name_pattern **set = exclude ? &filters.exclude : &filters.include;
+    size_t *n = exclude ? &filters.nexclude : &filters.ninclude;
+    struct name_pattern *tmp = realloc(*set, (*n + 1) * sizeof(*tmp));
+    if (!tmp) { perror("realloc"); return -1; }
+    *set = tmp;
+    struct name_pattern *p = &tmp[*n];
+    p->glob = regex ? NULL : arg;
+    if (regex) {
+        int rc = regcomp(&p->re, arg, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char msg[256];
+            regerror(rc, &p->re, msg, sizeof(msg));
+            fprintf(stderr, "invalid regex '%s': %s\n", arg, msg);
+            return -1;
+        }
+    }
+    ++*n;
+    return 0;
+}
+
+/* --type letters as in find -type, optionally separated by commas */
+static int filter_parse_types(const char *arg) {
+    for (const char *c = arg; *c; ++c) {
+        switch (*c) {
+            case 'f': filters.types |= FILTER_TYPE_BIT(S_IFREG); break;
+            case 'd': filters.types |= FILTER_TYPE_BIT(S_IFDIR); break;
+            case 'l': filters.types |= FILTER_TYPE_BIT(S_IFLNK); break;
+            case 'p': filters.types |= FILTER_TYPE_BIT(S_IFIFO); break;
+            case 's': filters.types |= FILTER_TYPE_BIT(S_IFSOCK); break;
+            case 'b': filters.types |= FILTER_TYPE_BIT(S_IFBLK); break;
+            case 'c': filters.types |= FILTER_TYPE_BIT(S_IFCHR); break;
+            case ',': break;
+            default: return -1;
+        }
+    }
+    return filters.types ? 0 : -1;
+}
+
+/* [+-]N[KMG]: larger than, smaller than or exactly N bytes */
+static int filter_parse_size(const char *arg) {
+    char cmp = (arg[0] == '+' || arg[0] == '-') ? *arg++ : '=';
+    size_t v;
+    if (parse_size(arg, &v) == -1) return -1;
+    filters.size_cmp = cmp;
+    filters.size = (off_t)v;
+    return 0;
+}
+
+/* [+-]N[smhd]: modified within the last N (bare N too) or longer ago */
+static int filter_parse_age(const char *arg) {
+    char cmp = (arg[0] == '+' || arg[0] == '-') ? *arg++ : '-';
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || end == arg) return -1;
+    switch (*end) {
+        case 's': ++end; break;
+        case 'm': v *= 60; ++end; break;
+        case 'h': v *= 3600; ++end; break;
+        case 'd': v *= 86400; ++end; break;
+        case '\0': v *= 86400; break;
+        default: return -1;
+    }
+    if (*end != '\0') return -1;
+    filters.mtime_cmp = cmp;
+    filters.age = (time_t)v;
+    return 0;
+}
+
+static int match_any(const struct name_pattern *p, size_t n, const char *name) {
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i].glob ? fnmatch(p[i].glob, name, 0) == 0 : regexec(&p[i].re, name, 0, NULL, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* File type bits for a readdir d_type, 0 when it says nothing */
+static mode_t dtype_mode(unsigned char d_type) {
+    switch (d_type) {
+        case DT_DIR:  return S_IFDIR;
+        case DT_LNK:  return S_IFLNK;
+        case DT_REG:  return S_IFREG;
+        case DT_CHR:  return S_IFCHR;
+        case DT_BLK:  return S_IFBLK;
+        case DT_FIFO: return S_IFIFO;
+        case DT_SOCK: return S_IFSOCK;
+        default: return 0;
+    }
+}
+
+/* Read-time test on the raw name, before the entry is copied or stat'ed:
+ * 0 drops it. Directories and unknown types only face the excludes here. */
+static int filter_name(const char *name, unsigned char d_type) {
+    if (filters.nexclude && match_any(filters.exclude, filters.nexclude, name)) return 0;
+    mode_t type = dtype_mode(d_type);
+    if (type == 0 || type == S_IFDIR) return 1;
+    if (filters.types && !(filters.types & FILTER_TYPE_BIT(type))) return 0;
+    if (filters.ninclude && !match_any(filters.include, filters.ninclude, name)) return 0;
+    return 1;
+}
+
+/* The remaining tests for one entry that passed filter_name */
+static enum filter_verdict filter_entry(const struct dir_ctx *dir, struct entry *e) {
+    unsigned want = (filters.size_cmp ? STATX_SIZE : 0) | (filters.mtime_cmp ? STATX_MTIME : 0);
+    if (want) {
+        /* one statx covering the type and whatever the output asks for next */
+        want |= opts.du ? META_DU : (opts.long_format || opts.format != OUT_TEXT) ? META_LONG : META_TYPE;
+        if (e->d_type == DT_UNKNOWN && !entry_stat(dir, e, want)) return FILTER_DROP;
+    }
+    mode_t type = entry_type(dir, e);
+    int shown = !filters.types || (filters.types & FILTER_TYPE_BIT(type));
+    if (type == S_IFDIR) return shown ? FILTER_SHOW : opts.recursive ? FILTER_DESCEND : FILTER_DROP;
+    if (!shown) return FILTER_DROP;
+    if (e->d_type == DT_UNKNOWN && filters.ninclude && !match_any(filters.include, filters.ninclude, e->name))
+        return FILTER_DROP;
+    if (!want) return FILTER_SHOW;
+    const struct stat *st = entry_stat(dir, e, want);
+    if (!st) return FILTER_DROP;
+    if (filters.size_cmp == '+' ? st->st_size <= filters.size
+        : filters.size_cmp == '-' ? st->st_size >= filters.size
+        : filters.size_cmp == '=' && st->st_size != filters.size) return FILTER_DROP;
+    time_t age = opts.now - st->st_mtim.tv_sec;
+    if (filters.mtime_cmp == '-' ? age > filters.age
+        : filters.mtime_cmp == '+' && age <= filters.age) return FILTER_DROP;
+    return FILTER_SHOW;
+}
+
+/* --watch entries that are gone (removals, additions vanished before the
+ * stat): only the name and whether it was a directory are known, so
+ * --size and --mtime let them through */
+static int filter_gone(const char *name, int is_dir) {
+    if (is_dir) return !filters.types || (filters.types & FILTER_TYPE_BIT(S_IFDIR));
+    if (filters.types && !(filters.types & ~FILTER_TYPE_BIT(S_IFDIR))) return 0;
+    return !filters.ninclude || match_any(filters.include, filters.ninclude, name);
+}
+
+/* Apply the tests filter_name could not settle to a read listing; the
+ * directories --type hides go to ls->descend for -R */
+static void filter_listing(const struct dir_ctx *dir, struct listing *ls) {
+    if (!filters.post || ls->count == 0) return;
+    if (opts.uring && (filters.size_cmp || filters.mtime_cmp)) stat_ring_fill(dir, ls);
+    size_t kept = 0;
+    for (size_t i = 0; i < ls->count; ++i) {
+        struct entry *e = ls->list[i];
+        switch (filter_entry(dir, e)) {
+            case FILTER_SHOW: ls->list[kept++] = e; break;
+            case FILTER_DESCEND:
+                if (!ls->descend) {
+                    ls->descend = arena_alloc(ls->arena, ls->count * sizeof(*ls->descend));
+                    if (!ls->descend) { perror("malloc"); break; }
+                }
+                ls->descend[ls->ndescend++] = e;
+                break;
+            case FILTER_DROP: break;
+        }
+    }
+    ls->count = kept;
+}
+
+static void filter_free(void) {
+    for (size_t i = 0; i < filters.ninclude; ++i)
+        if (!filters.include[i].glob) regfree(&filters.include[i].re);
+    for (size_t i = 0; i < filters.nexclude; ++i)
+        if (!filters.exclude[i].glob) regfree(&filters.exclude[i].re);
+    free(filters.include);
+    free(filters.exclude);
+}
+
+/* ---------- directory reading backends ---------- */
+/* Append an entry; with copy set the name is stored right behind the record,
+ * otherwise it must already live in memory that outlives the listing (the
+ * same arena, or the --index mapping) */
+static int listing_add(struct listing *ls, const char *name, size_t len, unsigned char d_type, int copy) {
+    if (ls->count >= ls->cap) {
+        /* grow geometrically; the old array stays in the arena until release */
+        size_t ncap = ls->cap ? ls->cap * 2 : 64;
+        struct entry **tmp = arena_alloc(ls->arena, ncap * sizeof(struct entry *));
+        if (!tmp) { perror("malloc"); return -1; }
+        if (ls->count) memcpy(tmp, ls->list, ls->count * sizeof(struct entry *));
+        ls->list = tmp; ls->cap = ncap;
+    }
+    struct entry *e = arena_alloc(ls->arena, sizeof(struct entry) + (copy ? len + 1 : 0));
+    if (!e) { perror("malloc"); return -1; }
+    if (copy) {
+        e->name = (char *)(e + 1);
+        memcpy(e->name, name, len + 1);
+    } else {
+        e->name = (char *)name;
+    }
+    e->d_type = d_type;
+    e->stat_mask = 0;
+    e->stat_failed = 0;
+    ls->list[ls->count++] = e;
+    return 0;
+}
+
+/* Streaming: pass the pending entries on, then drop them and their memory */
+static void listing_emit(struct listing *ls) {
+    tl_stats.entries += ls->count;
+    if (ls->count) ls->emit(ls, ls->emit_arg);
+    arena_release(ls->arena, ls->mark);
+    ls->list = ls->descend = NULL;
+    ls->count = ls->cap = ls->ndescend = 0;
+}
+
+/* readdir backend: one entry per call, each name copied into the arena */
+static int read_dir_readdir(int fd, const char *path, struct listing *ls) {
+    /* fdopendir takes ownership of its fd; read through a duplicate so the DIR
+     * buffer can be released before recursing while fd stays usable for *at() */
+    int rfd = dup(fd);
+    DIR *dp = rfd == -1 ? NULL : fdopendir(rfd);
+    if (!dp) {
+        fprintf(stderr, "Cannot open directory '%s': %s\n", path, strerror(errno));
+        if (rfd != -1) close(rfd);
+        return -1;
+    }
+
+    struct dirent *de;
+    errno = 0;
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.' && !opts.all) continue;
+        if (filters.active && !filter_name(de->d_name, de->d_type)) continue;
+        if (listing_add(ls, de->d_name, strlen(de->d_name), de->d_type, 1) == -1) break;
+        if (ls->emit && ls->count >= (opts.chunk ? opts.chunk : STREAM_BATCH)) listing_emit(ls);
+    }
+    if (errno) perror("readdir");
+    closedir(dp);
+    return 0;
+}
+
+/* getdents64 backend: read large batches straight from fd into the arena and
+ * parse the records in place; names are not copied, the batches back them */
+static int read_dir_getdents(int fd, const char *path, struct listing *ls) {
+    for (;;) {
+        char *buf = arena_alloc(ls->arena, opts.getdents_bufsize);
+        if (!buf) { perror("malloc"); break; }
+        long n = syscall(SYS_getdents64, fd, buf, opts.getdents_bufsize);
+        if (n <= 0) {
+            if (n == -1) fprintf(stderr, "getdents64 %s: %s\n", path, strerror(errno));
+            arena_trim(ls->arena, buf, 0);
+            break;
+        }
+        /* give back the unused tail so the following entries are packed behind it */
+        arena_trim(ls->arena, buf, (size_t)n);
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && !opts.all) continue;
+            if (filters.active && !filter_name(d->d_name, d->d_type)) continue;
+            if (listing_add(ls, d->d_name, 0, d->d_type, 0) == -1) return 0;
+        }
+        /* the names point into buf, so a batch can only end with it */
+        if (ls->emit) listing_emit(ls);
+    }
+    return 0;
+}
+
+/* ---------- io_uring statx engine (--uring) ---------- */
+#ifdef HAVE_IO_URING
+static _Thread_local struct stat_ring *stat_ring;
+
+/* Set up this thread's ring on first use; 0 when it is ready */
+static int stat_ring_setup(void) {
+    if (stat_ring) return stat_ring->state == 1 ? 0 : -1;
+    struct stat_ring *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
+    stat_ring = r;
+    r->state = -1;
+    r->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &p);
+    if (r->fd == -1) return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) { r->sq_ptr = NULL; return -1; }
+    r->cq_ptr = single ? r->sq_ptr
+                       : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) { r->cq_ptr = NULL; return -1; }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; return -1; }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->state = 1;
+    return 0;
+}
+
+static void stat_ring_teardown(void) {
+    struct stat_ring *r = stat_ring;
+    if (!r) return;
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd != -1) close(r->fd);
+    free(r);
+    stat_ring = NULL;
+}
+
+/* Submit up to n statx requests for batch[] and wait for all of them. Entries
+ * whose request fails stay without META_LONG, so entry_stat retries them
+ * synchronously and reports the error the usual way. */
+static void stat_ring_batch(struct stat_ring *r, const struct dir_ctx *dir, struct entry **batch, unsigned n) {
+    unsigned tail = *r->sq_tail, mask = *r->sq_mask;
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned idx = (tail + i) & mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir->fd;
+        sqe->addr = (uint64_t)(uintptr_t)batch[i]->name;
+        sqe->len = META_LONG;
+        sqe->off = (uint64_t)(uintptr_t)&r->bufs[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW | opts.statx_sync;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    unsigned to_submit = n, reaped = 0;
+    while (reaped < n) {
+        long rc = syscall(__NR_io_uring_enter, r->fd, to_submit, n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            r->state = -1;   /* give up on the ring; the rest goes synchronous */
+            return;
+        }
+        if (rc > 0 && (unsigned)rc <= to_submit) to_submit -= (unsigned)rc;
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->res == 0 && cqe->user_data < n) {
+                struct entry *e = batch[cqe->user_data];
+                statx_to_stat(&r->bufs[cqe->user_data], &e->st);
+                e->stat_mask = r->bufs[cqe->user_data].stx_mask | META_LONG;
+            } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                r->state = -1;   /* kernel without IORING_OP_STATX */
+            }
+            ++head;
+            ++reaped;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Stat every not-yet-stat'ed entry of ls through the ring, in batches */
+static void stat_ring_fill(const struct dir_ctx *dir, struct listing *ls) {
+    if (stat_ring_setup() == -1) return;
+    struct entry *batch[STAT_RING_ENTRIES];
+    unsigned n = 0;
+    for (size_t i = 0; i < ls->count && stat_ring->state == 1; ++i) {
+        struct entry *e = ls->list[i];
+        if (e->stat_failed || (e->stat_mask & META_LONG) == META_LONG) continue;
+        batch[n++] = e;
+        if (n == STAT_RING_ENTRIES) {
+            struct stats_span span = stats_begin();
+            stat_ring_batch(stat_ring, dir, batch, n);
+            stats_end(PH_STAT, span);
+            n = 0;
+        }
+    }
+    if (n && stat_ring->state == 1) {
+        struct stats_span span = stats_begin();
+        stat_ring_batch(stat_ring, dir, batch, n);
+        stats_end(PH_STAT, span);
+    }
+}
+#else
+static void stat_ring_fill(const struct dir_ctx *dir, struct listing *ls) { (void)dir; (void)ls; }
+static void stat_ring_teardown(void) { }
+#endif
+
+/* ---------- sorting ---------- */
+/* An entry with the first 8 bytes of its name packed big-endian, so comparing
+ * keys as integers orders like strcmp on those bytes without touching the
+ * name. A zero low byte means the name ended inside the key. */
+struct sort_item {
+    uint64_t key;
+    struct entry *e;
+};
+
+#define SORT_RADIX_MIN 64   /* below this a bucket is insertion-sorted */
+
+static uint64_t name_key(const char *name) {
+    uint64_t k = 0;
+    int i = 0;
+    for (; i < 8 && name[i]; ++i) k = (k << 8) | (unsigned char)name[i];
+    return k << (8 * (8 - i));
+}
+
+/* Full order: prefix first, the rest of the names only on a tie */
+static int sort_item_cmp(const struct sort_item *a, const struct sort_item *b) {
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    if ((a->key & 0xff) == 0) return 0;
+    return strcmp(a->e->name + 8, b->e->name + 8);
+}
+
+static void sort_insertion(struct sort_item *v, size_t n) {
+    for (size_t i = 1; i < n; ++i) {
+        struct sort_item x = v[i];
+        size_t j = i;
+        while (j > 0 && sort_item_cmp(&x, &v[j - 1]) < 0) { v[j] = v[j - 1]; --j; }
+        v[j] = x;
+    }
+}
+
+static int sort_tail_cmp(const void *a, const void *b) {
+    return sort_item_cmp(a, b);
+}
+
+/* MSD radix sort of v[0..n) on key byte `byte` (0 = most significant) and
+ * below, using tmp[0..n) as the scatter buffer */
+static void sort_radix(struct sort_item *v, struct sort_item *tmp, size_t n, int byte) {
+    if (n < SORT_RADIX_MIN) { sort_insertion(v, n); return; }
+    if (byte == 8) {
+        /* whole prefix equal: only the name tails can still differ */
+        if (v[0].key & 0xff) qsort(v, n, sizeof(*v), sort_tail_cmp);
+        return;
+    }
+    size_t count[256] = { 0 }, start[256];
+    int shift = 8 * (7 - byte);
+    for (size_t i = 0; i < n; ++i) count[(v[i].key >> shift) & 0xff]++;
+    size_t pos = 0;
+    for (int b = 0; b < 256; ++b) { start[b] = pos; pos += count[b]; }
+    for (size_t i = 0; i < n; ++i) tmp[start[(v[i].key >> shift) & 0xff]++] = v[i];
+    memcpy(v, tmp, n * sizeof(*v));
+
+    /* bucket 0 holds names that ended before this byte: all equal */
+    pos = count[0];
+    for (int b = 1; b < 256; ++b) {
+        if (count[b] > 1) sort_radix(v + pos, tmp, count[b], byte + 1);
+        pos += count[b];
+    }
+}
+
+/* One thread's share of the parallel sort: radix-sort a run, or merge two
+ * adjacent sorted runs a and b into out */
+struct sort_task {
+    struct sort_item *v, *tmp;
+    size_t n;
+    const struct sort_item *a, *b;
+    size_t na, nb;
+    struct sort_item *out;
+    pthread_t tid;
+    int started;
+};
+
+static void *sort_run_main(void *arg) {
+    struct sort_task *t = arg;
+    sort_radix(t->v, t->tmp, t->n, 0);
+    return NULL;
+}
+
+static void *sort_merge_main(void *arg) {
+    struct sort_task *t = arg;
+    const struct sort_item *a = t->a, *ae = t->a + t->na;
+    const struct sort_item *b = t->b, *be = t->b + t->nb;
+    struct sort_item *o = t->out;
+    while (a < ae && b < be) *o++ = sort_item_cmp(b, a) < 0 ? *b++ : *a++;
+    while (a < ae) *o++ = *a++;
+    while (b < be) *o++ = *b++;
+    return NULL;
+}
+
+/* Run fn on every task, on its own thread where one can be created */
+static void sort_run_tasks(struct sort_task *t, int n, void *(*fn)(void *)) {
+    for (int i = 0; i < n; ++i)
+        t[i].started = n > 1 && pthread_create(&t[i].tid, NULL, fn, &t[i]) == 0;
+    for (int i = 0; i < n; ++i) {
+        if (t[i].started) pthread_join(t[i].tid, NULL);
+        else fn(&t[i]);
+    }
+}
+
+/* Parallel merge sort of items[0..n): one radix-sorted run per thread, then
+ * log2(runs) rounds of pairwise merges between items and tmp. Returns the
+ * array holding the result. */
+static struct sort_item *sort_parallel(struct sort_item *items, struct sort_item *tmp, size_t n, int threads) {
+    struct sort_task task[SORT_MAX_THREADS];
+    size_t bound[SORT_MAX_THREADS + 1];
+    int runs = threads;
+
+    for (int i = 0; i <= runs; ++i) bound[i] = n * (size_t)i / (size_t)runs;
+    for (int i = 0; i < runs; ++i) {
+        task[i].v = items + bound[i];
+        task[i].tmp = tmp + bound[i];
+        task[i].n = bound[i + 1] - bound[i];
+    }
+    sort_run_tasks(task, runs, sort_run_main);
+
+    struct sort_item *src = items, *dst = tmp;
+    while (runs > 1) {
+        int pairs = runs / 2;
+        for (int i = 0; i < pairs; ++i) {
+            size_t lo = bound[2 * i], mid = bound[2 * i + 1], hi = bound[2 * i + 2];
+            task[i].a = src + lo; task[i].na = mid - lo;
+            task[i].b = src + mid; task[i].nb = hi - mid;
+            task[i].out = dst + lo;
+        }
+        if (runs & 1) {   /* odd run out: carried over unchanged */
+            size_t lo = bound[runs - 1], hi = bound[runs];
+            memcpy(dst + lo, src + lo, (hi - lo) * sizeof(*src));
+        }
+        sort_run_tasks(task, pairs, sort_merge_main);
+        for (int i = 0; i < pairs; ++i) bound[i + 1] = bound[2 * i + 2];
+        if (runs & 1) bound[pairs + 1] = bound[runs];
+        runs = pairs + (runs & 1);
+        struct sort_item *sw = src; src = dst; dst = sw;
+    }
+    return src;
+}
+
+/* Sort list by name; falls back to plain qsort if the keys cannot be built */
+static void sort_entries(struct entry **list, size_t count) {
+    if (count < 2) return;
+    struct sort_item *items = malloc(count * 2 * sizeof(*items));
+    if (!items) { qsort(list, count, sizeof(*list), entry_cmp); return; }
+    for (size_t i = 0; i < count; ++i) {
+        items[i].key = name_key(list[i]->name);
+        items[i].e = list[i];
+    }
+    struct sort_item *sorted = items;
+    if (opts.sort_parallel_min && count >= opts.sort_parallel_min && opts.ncpus > 1)
+        sorted = sort_parallel(items, items + count, count, opts.ncpus);
+    else
+        sort_radix(items, items + count, count, 0);
+    for (size_t i = 0; i < count; ++i) list[i] = sorted[i].e;
+    free(items);
+}
+
+/* -t / -S order: newest or largest first, then by name. Entries that could
+ * not be stat'ed count as time 0 / size 0. */
+static int entry_order(const struct entry *a, const struct entry *b) {
+    if (opts.sort_by == SORT_TIME) {
+        struct timespec ta = a->stat_failed ? (struct timespec){ 0, 0 } : a->st.st_mtim;
+        struct timespec tb = b->stat_failed ? (struct timespec){ 0, 0 } : b->st.st_mtim;
+        if (ta.tv_sec != tb.tv_sec) return ta.tv_sec > tb.tv_sec ? -1 : 1;
+        if (ta.tv_nsec != tb.tv_nsec) return ta.tv_nsec > tb.tv_nsec ? -1 : 1;
+    } else if (opts.sort_by == SORT_SIZE) {
+        off_t sa = a->stat_failed ? 0 : a->st.st_size;
+        off_t sb = b->stat_failed ? 0 : b->st.st_size;
+        if (sa != sb) return sa > sb ? -1 : 1;
+    }
+    return strcmp(a->name, b->name);
+}
+
+static int entry_order_cmp(const void *a, const void *b) {
+    return entry_order(*(struct entry *const *)a, *(struct entry *const *)b);
+}
+
+/* Restore the max-heap (worst entry on top) below slot i of h[0..n) */
+static void heap_sift_down(struct entry **h, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, worst = i;
+        if (l < n && entry_order(h[l], h[worst]) > 0) worst = l;
+        if (l + 1 < n && entry_order(h[l + 1], h[worst]) > 0) worst = l + 1;
+        if (worst == i) return;
+        struct entry *t = h[i]; h[i] = h[worst]; h[worst] = t;
+        i = worst;
+    }
+}
+
+/* Move the first k entries of list[0..n) in sort order to list[0..k), sorted:
+ * a max-heap of the best k seen so far, replacing its worst entry whenever a
+ * better one turns up, so only k entries are ever ordered */
+static void select_top(struct entry **list, size_t n, size_t k) {
+    for (size_t i = k / 2; i-- > 0; ) heap_sift_down(list, k, i);
+    for (size_t i = k; i < n; ++i) {
+        if (entry_order(list[i], list[0]) >= 0) continue;
+        struct entry *t = list[0]; list[0] = list[i]; list[i] = t;
+        heap_sift_down(list, k, 0);
+    }
+    qsort(list, k, sizeof(*list), entry_order_cmp);
+}
+
+/* Put a freshly read listing in display order and apply --head */
+static void order_listing(const struct dir_ctx *dir, struct listing *ls) {
+    size_t count = ls->count;
+    if (opts.unsorted) {
+        if (opts.head && count > opts.head) ls->count = opts.head;
+        return;
+    }
+    struct stats_span span = stats_begin();
+    if (opts.sort_by != SORT_NAME) {
+        /* one stat per entry; with -l fetch everything it prints right away */
+        unsigned want = opts.long_format ? META_LONG
+                      : opts.sort_by == SORT_TIME ? (STATX_TYPE | STATX_MTIME)
+                                                  : (STATX_TYPE | STATX_SIZE);
+        if (opts.uring) stat_ring_fill(dir, ls);
+        for (size_t i = 0; i < count; ++i) entry_stat(dir, ls->list[i], want);
+    }
+    if (opts.head && count > opts.head) {
+        select_top(ls->list, count, opts.head);
+        ls->count = opts.head;
+    } else if (opts.sort_by == SORT_NAME) {
+        sort_entries(ls->list, count);
+    } else if (count > 1) {
+        qsort(ls->list, count, sizeof(*ls->list), entry_order_cmp);
+    }
+    stats_end(PH_SORT, span);
+}
+
+/* ---------- structured output (--format) ---------- */
+/* One-letter type as in the first column of -l, '?' when unknown */
+static char type_letter(mode_t type) {
+    switch (type) {
+        case S_IFDIR:  return 'd';
+        case S_IFLNK:  return 'l';
+        case S_IFREG:  return '-';
+        case S_IFCHR:  return 'c';
+        case S_IFBLK:  return 'b';
+        case S_IFIFO:  return 'p';
+        case S_IFSOCK: return 's';
+        default:       return '?';
+    }
+}
+
+/* Whether str is well-formed UTF-8: no stray or missing continuation
+ * bytes, overlong forms, surrogates or code points past U+10FFFF */
+static int utf8_valid(const char *str) {
+    const unsigned char *s = (const unsigned char *)str;
+    while (*s) {
+        uint32_t c = *s, min;
+        size_t n;
+        if (c < 0x80) { ++s; continue; }
+        if ((c & 0xe0) == 0xc0) { n = 1; min = 0x80; c &= 0x1f; }
+        else if ((c & 0xf0) == 0xe0) { n = 2; min = 0x800; c &= 0x0f; }
+        else if ((c & 0xf8) == 0xf0) { n = 3; min = 0x10000; c &= 0x07; }
+        else return 0;
+        for (size_t i = 1; i <= n; ++i) {
+            if ((s[i] & 0xc0) != 0x80) return 0;
+            c = (c << 6) | (s[i] & 0x3f);
+        }
+        if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+        s += n + 1;
+    }
+    return 1;
+}
+
+/* s as a JSON string body: quote, backslash and control bytes escaped.
+ * When s is not valid UTF-8 each byte becomes one code point, the high ones
+ * as \u0080-\u00ff, and 1 is returned so the caller can flag the field. */
+static int json_string(struct outbuf *ob, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    int bytes = !utf8_valid(s);
+    const char *run = s;
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || !bytes)) continue;
+        ob_write(ob, run, (size_t)(s - run));
+        char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+        if (c == '"' || c == '\\') { esc[1] = (char)c; ob_write(ob, esc, 2); }
+        else if (c == '\n') ob_write(ob, "\\n", 2);
+        else if (c == '\t') ob_write(ob, "\\t", 2);
+        else ob_write(ob, esc, 6);
+        run = s + 1;
+    }
+    ob_write(ob, run, (size_t)(s - run));
+    return bytes;
+}
+
+/* ,"<key>_bytes":true after a string json_string wrote byte-wise */
+static void json_bytes_flag(struct outbuf *ob, const char *key) {
+    ob_write(ob, ",\"", 2);
+    ob_puts(ob, key);
+    ob_write(ob, "_bytes\":true", 12);
+}
+
+static void json_field(struct outbuf *ob, const char *key, long long v) {
+    ob_putc(ob, ',');
+    ob_putc(ob, '"');
+    ob_puts(ob, key);
+    ob_write(ob, "\":", 2);
+    ob_num(ob, v, 0);
+}
+
+static void json_text_field(struct outbuf *ob, const char *key, const char *v) {
+    ob_write(ob, ",\"", 2);
+    ob_puts(ob, key);
+    ob_write(ob, "\":", 2);
+    if (!v) { ob_write(ob, "null", 4); return; }
+    ob_putc(ob, '"');
+    int bytes = json_string(ob, v);
+    ob_putc(ob, '"');
+    if (bytes) json_bytes_flag(ob, key);
+}
+
+static void put_ndjson_record(const struct dir_ctx *dir, struct entry *e, const struct stat *st) {
+    struct outbuf *ob = dir->out;
+    ob_write(ob, "{\"dir\":\"", 8);
+    int bytes = json_string(ob, dir->path);
+    ob_putc(ob, '"');
+    if (bytes) json_bytes_flag(ob, "dir");
+    ob_write(ob, ",\"name\":\"", 9);
+    bytes = json_string(ob, e->name);
+    ob_putc(ob, '"');
+    if (bytes) json_bytes_flag(ob, "name");
+    ob_write(ob, ",\"type\":\"", 9);
+    ob_putc(ob, type_letter(st ? (mode_t)(st->st_mode & S_IFMT) : entry_type(dir, e)));
+    ob_putc(ob, '"');
+    if (st) {
+        json_field(ob, "ino", (long long)st->st_ino);
+        json_field(ob, "mode", (long long)(st->st_mode & 07777));
+        json_field(ob, "nlink", (long long)st->st_nlink);
+        json_field(ob, "uid", (long long)st->st_uid);
+        json_field(ob, "gid", (long long)st->st_gid);
+        json_field(ob, "size", (long long)st->st_size);
+        json_field(ob, "blocks", (long long)st->st_blocks);
+        json_field(ob, "mtime", (long long)st->st_mtim.tv_sec);
+        json_field(ob, "mtime_ns", (long long)st->st_mtim.tv_nsec);
+        if (opts.with_names) {
+            json_text_field(ob, "user", cached_name(&user_cache, st->st_uid));
+            json_text_field(ob, "group", cached_name(&group_cache, st->st_gid));
+        }
+        if (opts.with_time) {
+            char tbuf[64];
+            format_mtime(st->st_mtime, tbuf, sizeof(tbuf));
+            json_text_field(ob, "time", tbuf);
+        }
+    }
+    ob_write(ob, "}\n", 2);
+}
+
+static void put_le(struct outbuf *ob, uint64_t v, int bytes) {
+    unsigned char b[8];
+    for (int i = 0; i < bytes; ++i) b[i] = (unsigned char)(v >> (8 * i));
+    ob_write(ob, b, (size_t)bytes);
+}
+
+/* Short string: one length byte (capped at 255), then the bytes */
+static void put_short_str(struct outbuf *ob, const char *s) {
+    size_t n = s ? strlen(s) : 0;
+    if (n > 255) n = 255;
+    put_le(ob, n, 1);
+    ob_write(ob, s, n);
+}
+
+/*
+ * Binary record, all integers little-endian:
+ *   u32 length of the rest of the record
+ *   u32 flags (REC_STAT, REC_NAMES, REC_TIME)
+ *   u8  type letter, u8 0, u16 name length, u32 dir length
+ *   u64 ino, size, blocks; i64 mtime; u32 mtime_ns, mode, nlink, uid, gid
+ *       (zero unless REC_STAT)
+ *   dir bytes, name bytes
+ *   REC_NAMES: u8 len + user, u8 len + group (len 0 when there is none)
+ *   REC_TIME:  u8 len + formatted time
+ */
+#define REC_FIXED (4 + 4 + 8 + 3 * 8 + 8 + 5 * 4)
+
+static void put_binary_record(const struct dir_ctx *dir, struct entry *e, const struct stat *st) {
+    struct outbuf *ob = dir->out;
+    size_t dlen = strlen(dir->path), nlen = strlen(e->name);
+    const char *user = NULL, *group = NULL;
+    char tbuf[64];
+    uint32_t flags = 0;
+    size_t extra = 0;
+    if (st) {
+        flags |= REC_STAT;
+        if (opts.with_names) {
+            flags |= REC_NAMES;
+            user = cached_name(&user_cache, st->st_uid);
+            group = cached_name(&group_cache, st->st_gid);
+            size_t ul = user ? strlen(user) : 0, gl = group ? strlen(group) : 0;
+            extra += 2 + (ul > 255 ? 255 : ul) + (gl > 255 ? 255 : gl);
+        }
+        if (opts.with_time) {
+            flags |= REC_TIME;
+            extra += 1 + format_mtime(st->st_mtime, tbuf, sizeof(tbuf));
+        }
+    }
+    put_le(ob, REC_FIXED - 4 + dlen + nlen + extra, 4);
+    put_le(ob, flags, 4);
+    put_le(ob, (unsigned char)type_letter(st ? (mode_t)(st->st_mode & S_IFMT) : entry_type(dir, e)), 1);
+    put_le(ob, 0, 1);
+    put_le(ob, nlen, 2);
+    put_le(ob, dlen, 4);
+    put_le(ob, st ? (uint64_t)st->st_ino : 0, 8);
+    put_le(ob, st ? (uint64_t)st->st_size : 0, 8);
+    put_le(ob, st ? (uint64_t)st->st_blocks : 0, 8);
+    put_le(ob, st ? (uint64_t)st->st_mtim.tv_sec : 0, 8);
+    put_le(ob, st ? (uint64_t)st->st_mtim.tv_nsec : 0, 4);
+    put_le(ob, st ? st->st_mode & 07777 : 0, 4);
+    put_le(ob, st ? (uint64_t)st->st_nlink : 0, 4);
+    put_le(ob, st ? st->st_uid : 0, 4);
+    put_le(ob, st ? st->st_gid : 0, 4);
+    ob_write(ob, dir->path, dlen);
+    ob_write(ob, e->name, nlen);
+    if (flags & REC_NAMES) { put_short_str(ob, user); put_short_str(ob, group); }
+    if (flags & REC_TIME) put_short_str(ob, tbuf);
+}
+
+/* All entries of ls as --format records; an entry that cannot be stat'ed
+ * still gets a record, with the type from d_type and no stat fields */
+static void print_records(const struct dir_ctx *dir, struct listing *ls) {
+    if (opts.uring) stat_ring_fill(dir, ls);
+    for (size_t i = 0; i < ls->count; ++i) {
+        struct entry *e = ls->list[i];
+        const struct stat *st = entry_stat(dir, e, META_LONG);
+        if (opts.format == OUT_NDJSON) put_ndjson_record(dir, e, st);
+        else put_binary_record(dir, e, st);
+    }
+}
+
+/* ---------- directory listing and dispatch ---------- */
+/* Read, filter and sort one directory into ls (allocated from ls->arena); with
+ * ls->emit set the entries are streamed out instead and ls ends up empty */
+static int read_listing(const struct dir_ctx *dir, struct listing *ls) {
+    if (ls->emit) ls->mark = arena_mark(ls->arena);
+    struct stats_span span = stats_begin();
+    int rc = opts.backend == BACKEND_GETDENTS ? read_dir_getdents(dir->fd, dir->path, ls)
+                                              : read_dir_readdir(dir->fd, dir->path, ls);
+    stats_end(PH_READDIR, span);
+    tl_stats.dirs++;
+    if (ls->emit) listing_emit(ls);
+    if (rc == -1) return -1;
+    tl_stats.entries += ls->count;
+    filter_listing(dir, ls);
+    ls->total = ls->count;
+    order_listing(dir, ls);
+    if (ls->ndescend > 1 && !opts.unsorted) sort_entries(ls->descend, ls->ndescend);
+    return 0;
+}
+
+/* Directories the -R walk descends into */
+static int is_subdir(const struct dir_ctx *dir, struct entry *e) {
+    const char *n = e->name;
+    if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) return 0;
+    return entry_type(dir, e) == S_IFDIR;
+}
+
+static void print_header(const struct dir_ctx *dir) {
+    if (opts.recursive && opts.format == OUT_TEXT) { ob_puts(dir->out, dir->path); ob_write(dir->out, ":\n", 2); }
+}
+
+/* Blank line between directories; records and du lines need none */
+static void print_separator(struct outbuf *ob) {
+    if (opts.format == OUT_TEXT && !opts.du) ob_putc(ob, '\n');
+}
+
+/* Entries in -l, -1 or --format record form, which need no layout over the
+ * whole listing */
+static void print_lines(const struct dir_ctx *dir, struct listing *ls) {
+    if (opts.format != OUT_TEXT) {
+        print_records(dir, ls);
+    } else if (opts.long_format) {
+        if (opts.uring) stat_ring_fill(dir, ls);
+        for (size_t i = 0; i < ls->count; ++i) print_long_format(dir, ls->list[i]);
+    } else {
+        for (size_t i = 0; i < ls->count; ++i) {
+            color_print_name(dir, ls->list[i]);
+            ob_putc(dir->out, '\n');
+        }
+    }
+}
+
+/* The entries in the selected format */
+static void print_entries(const struct dir_ctx *dir, struct listing *ls) {
+    if (ls->count == 0) {
+        /* nothing to print */
+    } else if (opts.long_format || opts.one_per_line || opts.format != OUT_TEXT) {
+        print_lines(dir, ls);
+    } else if (opts.horizontal) {
+        print_horizontal(ls->list, ls->count, opts.term_width, dir);
+    } else {
+        print_columns(ls->list, ls->count, opts.term_width, dir);
+    }
+}
+
+/* Print the -R header and the entries */
+static void print_listing(const struct dir_ctx *dir, struct listing *ls) {
+    struct stats_span span = stats_begin();
+    print_header(dir);
+    print_entries(dir, ls);
+    stats_end(PH_FORMAT, span);
+}
+
+/* State of one streamed directory: where it prints and, for -R, the names of
+ * the subdirectories seen so far (the only thing kept across batches) */
+struct stream_ctx {
+    const struct dir_ctx *dir;
+    char **subdirs;
+    size_t nsub, capsub;
+    size_t printed;         /* against --head */
+};
+
+static void stream_emit(struct listing *ls, void *arg) {
+    struct stream_ctx *sc = arg;
+    filter_listing(sc->dir, ls);
+    if (opts.head && ls->count > opts.head - sc->printed) ls->count = opts.head - sc->printed;
+    sc->printed += ls->count;
+    struct stats_span span = stats_begin();
+    print_entries(sc->dir, ls);
+    stats_end(PH_FORMAT, span);
+    if (sc->dir->out->fd != -1) ob_flush(sc->dir->out);
+    if (!opts.recursive) return;
+    for (size_t i = 0; i < ls->count + ls->ndescend; ++i) {
+        struct entry *e = i < ls->count ? ls->list[i] : ls->descend[i - ls->count];
+        if (!is_subdir(sc->dir, e)) continue;
+        if (sc->nsub == sc->capsub) {
+            size_t ncap = sc->capsub ? sc->capsub * 2 : 16;
+            char **tmp = realloc(sc->subdirs, ncap * sizeof(*tmp));
+            if (!tmp) { perror("realloc"); return; }
+            sc->subdirs = tmp; sc->capsub = ncap;
+        }
+        char *copy = strdup(e->name);
+        if (!copy) { perror("strdup"); return; }
+        sc->subdirs[sc->nsub++] = copy;
+    }
+}
+
+/* -U/-f with -1, -l or --chunk: print as we read, in bounded batches.
+ * Returns the directory's fd, which -R may have replaced (see descend). */
+static int do_ls_stream(struct dir_ctx *dir) {
+    struct stream_ctx sc = { dir, NULL, 0, 0, 0 };
+    struct listing ls = { .arena = &walk_arena, .emit = stream_emit, .emit_arg = &sc };
+    print_header(dir);
+    read_listing(dir, &ls);
+
+    for (size_t i = 0; i < sc.nsub; ++i) {
+        char *sub = dir->fd == -1 ? NULL : join_path(dir->path, sc.subdirs[i]);
+        if (sub) {
+            print_separator(&out_stdout);
+            dir->fd = descend(dir->fd, sc.subdirs[i], sub);
+            free(sub);
+        } else if (dir->fd != -1) {
+            perror("asprintf");
+        }
+        free(sc.subdirs[i]);
+    }
+    free(sc.subdirs);
+    return dir->fd;
+}
+
+/* List directory 'name' opened relative to at_fd (AT_FDCWD for command line
+ * operands); 'path' is only used for -R headers and error messages. */
+void do_ls(int at_fd, const char *name, const char *path) {
+    int fd = openat(at_fd, name && name[0] ? name : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open directory '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    fd = list_dir(fd, path);
+    if (fd != -1) close(fd);
+}
+
+/* WALK_FD_DEPTH, or whatever RLIMIT_NOFILE leaves above WALK_FD_RESERVE */
+static void walk_fd_init(void) {
+    struct rlimit rl;
+    walk_fd_cap = WALK_FD_DEPTH;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur < (rlim_t)(WALK_FD_DEPTH + WALK_FD_RESERVE))
+        walk_fd_cap = rl.rlim_cur > WALK_FD_RESERVE ? (int)(rl.rlim_cur - WALK_FD_RESERVE) : 0;
+}
+
+/* List subdirectory name of the directory open as fd. Within walk_fd_cap
+ * open ancestors fd is kept and returned; deeper, it is closed while the
+ * subtree is listed, and the returned fd is the same directory reopened
+ * through "..", or -1 if it could not be found again. */
+static int descend(int fd, const char *name, const char *path) {
+    if (walk_depth < walk_fd_cap) {
+        ++walk_depth;
+        do_ls(fd, name, path);
+        --walk_depth;
+        return fd;
+    }
+    struct stat self;
+    int cfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cfd == -1 || fstat(fd, &self) == -1) {
+        fprintf(stderr, "Cannot open directory '%s': %s\n", path, strerror(errno));
+        if (cfd != -1) close(cfd);
+        return fd;
+    }
+    close(fd);
+    cfd = list_dir(cfd, path);
+    if (cfd == -1) return -1;   /* already reported further down */
+    fd = openat(cfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(cfd);
+    struct stat back;
+    if (fd != -1 && (fstat(fd, &back) == -1 || back.st_dev != self.st_dev || back.st_ino != self.st_ino)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) fprintf(stderr, "Cannot return from '%s': the tree changed during the walk\n", path);
+    return fd;
+}
+
+/* The body of do_ls for a directory already open as fd. Returns the fd to
+ * close, which descend may have replaced, or -1. */
+static int list_dir(int fd, const char *path) {
+    struct dir_ctx dir = { fd, path, &out_stdout };
+    if (opts.watch) watch_add(path);
+    /* --index needs the whole listing to record it, so it never streams */
+    if (opts.unsorted && !opts.index_path
+        && (opts.long_format || opts.one_per_line || opts.format != OUT_TEXT || opts.chunk))
+        return do_ls_stream(&dir);
+
+    /* everything below is released in one go when this directory is done */
+    struct arena_mark mark = arena_mark(&walk_arena);
+    struct listing ls = { .arena = &walk_arena };
+    /* with --index: the directory's own stat decides whether the snapshot
+     * still holds; it is taken before reading so a change that races with
+     * the read shows up as a mismatch next time */
+    struct stat dst;
+    int indexed = opts.index_path && fstat(fd, &dst) == 0;
+    const struct idx_dir *snap = indexed ? index_lookup(path, &dst) : NULL;
+    size_t nostat = SIZE_MAX;
+    if (snap) {
+        struct stats_span span = stats_begin();
+        nostat = index_load(snap, &ls);
+        stats_end(PH_READDIR, span);
+        tl_stats.dirs++;
+        tl_stats.entries += ls.count;
+        order_listing(&dir, &ls);
+    } else if (read_listing(&dir, &ls) == -1) {
+        arena_release(&walk_arena, mark);
+        return fd;
+    }
+
+    print_listing(&dir, &ls);
+    if (indexed) index_record(path, &dst, ls.list, ls.total, nostat);
+
+    /* Recursive part: the type comes from the same entry record the printers
+     * used, and each subdirectory is opened relative to this directory's fd */
+    if (opts.recursive) {
+        for (size_t i = 0; i < ls.count + ls.ndescend && dir.fd != -1; ++i) {
+            struct entry *e = i < ls.count ? ls.list[i] : ls.descend[i - ls.count];
+            if (!is_subdir(&dir, e)) continue;
+            char *sub = join_path(path, e->name);
+            if (!sub) { perror("asprintf"); continue; }
+            print_separator(&out_stdout);
+            dir.fd = descend(dir.fd, e->name, sub);
+            free(sub);
+        }
+    }
+
+    arena_release(&walk_arena, mark);
+    return dir.fd;
+}
+
+/* ---------- persistent metadata index (--index) ---------- */
+static uint64_t index_hash_more(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; ++i) { h ^= (unsigned char)s[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static uint64_t index_hash(const char *s, size_t len) {
+    return index_hash_more(1469598103934665603ULL, s, len);
+}
+
+/* Map the previous index; a missing or malformed file just means no snapshot */
+static void index_open(const char *path) {
+    meta_index.path = path;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) fprintf(stderr, "index %s: %s\n", path, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct idx_header)) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            const struct idx_header *h = m;
+            size_t len = (size_t)st.st_size;
+            if (memcmp(h->magic, INDEX_MAGIC, 8) == 0 && h->version == INDEX_VERSION &&
+                h->file_size == len && h->dirs_off <= len &&
+                h->ndirs <= (len - h->dirs_off) / sizeof(struct idx_dir)) {
+                meta_index.map = m;
+                meta_index.map_len = len;
+                meta_index.dirs = (const struct idx_dir *)((const char *)m + h->dirs_off);
+                meta_index.ndirs = h->ndirs;
+            } else {
+                fprintf(stderr, "index %s: not a valid index, rebuilding\n", path);
+                munmap(m, len);
+            }
+        }
+    }
+    close(fd);
+}
+
+static int index_dir_cmp(uint64_t hash, const char *path, size_t len, const struct idx_dir *d, const char *base) {
+    if (hash != d->hash) return hash < d->hash ? -1 : 1;
+    size_t n = len < d->path_len ? len : d->path_len;
+    int c = memcmp(path, base + d->path_off, n);
+    if (c) return c;
+    return len < d->path_len ? -1 : len > d->path_len;
+}
+
+/* The options that decide which entries a snapshot holds and in what order */
+static uint32_t index_flags(void) {
+    return (opts.all ? IDX_ALL : 0) | (opts.unsorted ? IDX_UNSORTED : 0);
+}
+
+/* Snapshot of path if the directory (stat'ed as dst) is unchanged since and
+ * was read under the same options */
+static const struct idx_dir *index_lookup(const char *path, const struct stat *dst) {
+    if (!meta_index.map) return NULL;
+    size_t len = strlen(path);
+    uint64_t h = index_hash(path, len);
+    size_t lo = 0, hi = meta_index.ndirs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct idx_dir *d = &meta_index.dirs[mid];
+        if (d->path_off > meta_index.map_len || d->path_len > meta_index.map_len - d->path_off) return NULL;
+        int c = index_dir_cmp(h, path, len, d, meta_index.map);
+        if (c < 0) hi = mid;
+        else if (c > 0) lo = mid + 1;
+        else {
+            if (d->dev != (uint64_t)dst->st_dev || d->ino != (uint64_t)dst->st_ino ||
+                d->mtime != dst->st_mtim.tv_sec || d->mtime_ns != (uint32_t)dst->st_mtim.tv_nsec ||
+                d->ctime != dst->st_ctim.tv_sec || d->ctime_ns != (uint32_t)dst->st_ctim.tv_nsec ||
+                d->flags != index_flags())
+                return NULL;
+            /* bounds of everything index_load will touch */
+            size_t m = meta_index.map_len;
+            if (d->ent_off > m || d->nent > (m - d->ent_off) / sizeof(struct idx_ent) ||
+                d->names_off > m || d->names_len > m - d->names_off ||
+                (d->names_len && meta_index.map[d->names_off + d->names_len - 1] != '\0'))
+                return NULL;
+            uint64_t sum = index_hash(meta_index.map + d->ent_off, d->nent * sizeof(struct idx_ent));
+            if (index_hash_more(sum, meta_index.map + d->names_off, d->names_len) != d->sum) return NULL;
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/* Non-directory entries without stat fields, the measure of how much a
+ * recorded snapshot could gain from this run */
+static size_t count_nostat(struct entry **list, size_t n) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (!list[i]->stat_mask && !list[i]->stat_failed && list[i]->d_type != DT_DIR) ++k;
+    return k;
+}
+
+/* Fill ls from a snapshot; names point into the mapping. Returns how many
+ * entries came without stat fields (see count_nostat). */
+static size_t index_load(const struct idx_dir *d, struct listing *ls) {
+    const struct idx_ent *ent = (const struct idx_ent *)(meta_index.map + d->ent_off);
+    const char *names = meta_index.map + d->names_off;
+    for (uint32_t i = 0; i < d->nent; ++i) {
+        const struct idx_ent *x = &ent[i];
+        if (x->name_off >= d->names_len || x->name_len >= d->names_len - x->name_off) continue;
+        if (listing_add(ls, names + x->name_off, 0, x->d_type, 0) == -1) break;
+        struct entry *e = ls->list[ls->count - 1];
+        e->stat_failed = x->stat_failed;
+        e->stat_mask = x->stat_mask & STATX_BASIC_STATS;
+        /* a subdirectory's own mtime/size change without touching this
+         * directory, so those rows are stat'ed afresh when needed */
+        if (x->d_type == DT_DIR || (x->mode & S_IFMT) == S_IFDIR) e->stat_mask = 0;
+        if (!e->stat_mask) continue;
+        struct stat *st = &e->st;
+        memset(st, 0, sizeof(*st));
+        st->st_ino = x->ino; st->st_size = (off_t)x->size; st->st_blocks = (blkcnt_t)x->blocks;
+        st->st_dev = x->dev; st->st_rdev = x->rdev;
+        st->st_mode = x->mode; st->st_nlink = x->nlink; st->st_uid = x->uid; st->st_gid = x->gid;
+        st->st_atim.tv_sec = x->atime; st->st_atim.tv_nsec = x->atime_ns;
+        st->st_mtim.tv_sec = x->mtime; st->st_mtim.tv_nsec = x->mtime_ns;
+        st->st_ctim.tv_sec = x->ctime; st->st_ctim.tv_nsec = x->ctime_ns;
+    }
+    ls->total = ls->count;
+    return count_nostat(ls->list, ls->count);
+}
+
+/* Keep the body 8-aligned so the records can be read in place after mmap */
+static uint64_t index_align(struct outbuf *b) {
+    static const char zero[8];
+    if (b->len & 7) ob_write(b, zero, 8 - (b->len & 7));
+    return sizeof(struct idx_header) + b->len;
+}
+
+/* Add one listed directory to the index written at exit. nostat is what
+ * index_load returned for a snapshot, SIZE_MAX for a directory read afresh;
+ * the index only needs rewriting if some directory was read or gained stats. */
+static void index_record(const char *path, const struct stat *dst, struct entry **list, size_t n, size_t nostat) {
+    struct meta_index *mi = &meta_index;
+    if (count_nostat(list, n) < nostat) mi->dirty = 1;
+    if (mi->new_count == mi->new_cap) {
+        size_t ncap = mi->new_cap ? mi->new_cap * 2 : 256;
+        struct idx_dir *tmp = realloc(mi->new_dirs, ncap * sizeof(*tmp));
+        if (!tmp) { perror("realloc"); return; }
+        mi->new_dirs = tmp; mi->new_cap = ncap;
+    }
+    struct idx_dir *d = &mi->new_dirs[mi->new_count++];
+    memset(d, 0, sizeof(*d));
+    size_t plen = strlen(path);
+    d->hash = index_hash(path, plen);
+    d->dev = dst->st_dev; d->ino = dst->st_ino;
+    d->mtime = dst->st_mtim.tv_sec; d->mtime_ns = (uint32_t)dst->st_mtim.tv_nsec;
+    d->ctime = dst->st_ctim.tv_sec; d->ctime_ns = (uint32_t)dst->st_ctim.tv_nsec;
+    d->path_off = sizeof(struct idx_header) + mi->body.len;
+    d->path_len = (uint32_t)plen;
+    d->flags = index_flags();
+    ob_write(&mi->body, path, plen);
+
+    d->ent_off = index_align(&mi->body);
+    d->nent = (uint32_t)n;
+    uint32_t name_off = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const struct entry *e = list[i];
+        const struct stat *st = &e->st;
+        struct idx_ent x;
+        memset(&x, 0, sizeof(x));
+        size_t nlen = strlen(e->name);
+        x.name_off = name_off;
+        x.name_len = (uint16_t)nlen;
+        name_off += (uint32_t)nlen + 1;
+        x.d_type = e->d_type;
+        x.stat_failed = (uint8_t)e->stat_failed;
+        x.stat_mask = e->stat_failed ? 0 : e->stat_mask;
+        if (x.stat_mask) {
+            x.ino = st->st_ino; x.size = (uint64_t)st->st_size; x.blocks = (uint64_t)st->st_blocks;
+            x.dev = st->st_dev; x.rdev = st->st_rdev;
+            x.mode = st->st_mode; x.nlink = (uint32_t)st->st_nlink; x.uid = st->st_uid; x.gid = st->st_gid;
+            x.atime = st->st_atim.tv_sec; x.atime_ns = (uint32_t)st->st_atim.tv_nsec;
+            x.mtime = st->st_mtim.tv_sec; x.mtime_ns = (uint32_t)st->st_mtim.tv_nsec;
+            x.ctime = st->st_ctim.tv_sec; x.ctime_ns = (uint32_t)st->st_ctim.tv_nsec;
+        }
+        ob_write(&mi->body, &x, sizeof(x));
+    }
+    d->names_off = sizeof(struct idx_header) + mi->body.len;
+    for (size_t i = 0; i < n; ++i) ob_write(&mi->body, list[i]->name, strlen(list[i]->name) + 1);
+    d->names_len = name_off;
+    const char *base = mi->body.buf - sizeof(struct idx_header);
+    d->sum = index_hash_more(index_hash(base + d->ent_off, n * sizeof(struct idx_ent)),
+                             base + d->names_off, d->names_len);
+    index_align(&mi->body);
+}
+
+static int idx_dir_sort_cmp(const void *a, const void *b) {
+    const struct idx_dir *x = a, *y = b;
+    const char *base = meta_index.body.buf - sizeof(struct idx_header);
+    return index_dir_cmp(x->hash, base + x->path_off, x->path_len, y, base);
+}
+
+static int write_all(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n > 0) {
+        ssize_t w = write(fd, c, n);
+        if (w == -1) { if (errno == EINTR) continue; return -1; }
+        c += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Replace the index file atomically: write a new temporary next to it, rename */
+static void index_write(void) {
+    struct meta_index *mi = &meta_index;
+    if (!mi->new_count) return;
+    /* every directory came from the mapping unchanged: leave the file alone */
+    if (!mi->dirty && mi->new_count == mi->ndirs) return;
+    qsort(mi->new_dirs, mi->new_count, sizeof(*mi->new_dirs), idx_dir_sort_cmp);
+    /* a directory listed twice (repeated operands) is kept once */
+    const char *base = mi->body.buf - sizeof(struct idx_header);
+    size_t n = 1;
+    for (size_t i = 1; i < mi->new_count; ++i) {
+        struct idx_dir *d = &mi->new_dirs[i];
+        if (index_dir_cmp(d->hash, base + d->path_off, d->path_len, &mi->new_dirs[n - 1], base) != 0)
+            mi->new_dirs[n++] = *d;
+    }
+
+    struct idx_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.ndirs = (uint32_t)n;
+    h.dirs_off = index_align(&mi->body);
+    h.file_size = h.dirs_off + n * sizeof(struct idx_dir);
+
+    char *tmp = NULL;
+    if (asprintf(&tmp, "%s.XXXXXX", mi->path) == -1) { perror("asprintf"); return; }
+    /* a fresh name (O_EXCL), so a planted file or symlink is never written
+     * through; mkstemp makes it 0600, give it the usual 0644 & ~umask */
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    int rc = fd == -1 ? -1 : 0;
+    if (rc == 0) {
+        mode_t mask = umask(0);
+        umask(mask);
+        rc = fchmod(fd, 0644 & ~mask);
+    }
+    if (rc == 0) rc = write_all(fd, &h, sizeof(h));
+    if (rc == 0) rc = write_all(fd, mi->body.buf, mi->body.len);
+    if (rc == 0) rc = write_all(fd, mi->new_dirs, n * sizeof(struct idx_dir));
+    if (fd != -1 && close(fd) == -1) rc = -1;
+    if (rc == -1) {
+        fprintf(stderr, "index %s: %s\n", tmp, strerror(errno));
+        if (fd != -1) unlink(tmp);
+    } else if (rename(tmp, mi->path) == -1) {
+        fprintf(stderr, "index %s: %s\n", mi->path, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+static void index_close(void) {
+    if (meta_index.map) munmap((void *)meta_index.map, meta_index.map_len);
+    free(meta_index.body.buf);
+    free(meta_index.new_dirs);
+}
+
+/* ---------- watch mode (--watch) ---------- */
+#define WATCH_COALESCE_MS 20   /* gather a burst of events into one batch */
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* The inotify instance and its watch descriptor -> directory path table */
+static struct {
+    int fd;
+    char **paths;
+    size_t cap, live;
+} watches = { -1, NULL, 0, 0 };
+
+static int watch_init(void) {
+    watches.fd = inotify_init1(IN_CLOEXEC);
+    if (watches.fd == -1) { perror("inotify_init1"); return -1; }
+    return 0;
+}
+
+static void watch_add(const char *path) {
+    int wd = inotify_add_watch(watches.fd, path, WATCH_MASK);
+    if (wd == -1) {
+        fprintf(stderr, "Cannot watch '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    if ((size_t)wd >= watches.cap) {
+        size_t ncap = watches.cap ? watches.cap : 64;
+        while (ncap <= (size_t)wd) ncap *= 2;
+        char **tmp = realloc(watches.paths, ncap * sizeof(*tmp));
+        if (!tmp) { perror("realloc"); return; }
+        memset(tmp + watches.cap, 0, (ncap - watches.cap) * sizeof(*tmp));
+        watches.paths = tmp; watches.cap = ncap;
+    }
+    /* adding a directory twice hands back the same wd */
+    if (watches.paths[wd]) free(watches.paths[wd]);
+    else ++watches.live;
+    watches.paths[wd] = strdup(path);
+}
+
+/* Paths reported with "+" in this batch ([0]) and the one before ([1]).
+ * A new directory is read right after its watch is added, so an entry
+ * created in between comes both from that read and, a batch later, as an
+ * event; the second report is dropped. A "-" takes the path out again. */
+static struct path_set {
+    char **slots;               /* open addressing; PATH_GONE marks a removal */
+    size_t cap, used;
+} watch_added[2];
+
+static char path_gone;
+#define PATH_GONE (&path_gone)
+
+/* Slot holding p, or the empty slot where the search for it ended */
+static size_t path_set_find(const struct path_set *s, const char *p) {
+    size_t j = index_hash(p, strlen(p)) & (s->cap - 1);
+    while (s->slots[j] && (s->slots[j] == PATH_GONE || strcmp(s->slots[j], p) != 0))
+        j = (j + 1) & (s->cap - 1);
+    return j;
+}
+
+static int path_set_has(const struct path_set *s, const char *p) {
+    return s->cap && s->slots[path_set_find(s, p)];
+}
+
+static void path_set_add(struct path_set *s, const char *p) {
+    if (2 * (s->used + 1) > s->cap) {
+        size_t ncap = s->cap ? s->cap * 2 : 64;
+        struct path_set grown = { calloc(ncap, sizeof(char *)), ncap, 0 };
+        if (!grown.slots) return;
+        for (size_t i = 0; i < s->cap; ++i) {
+            if (!s->slots[i] || s->slots[i] == PATH_GONE) continue;
+            grown.slots[path_set_find(&grown, s->slots[i])] = s->slots[i];
+            grown.used++;
+        }
+        free(s->slots);
+        *s = grown;
+    }
+    size_t j = path_set_find(s, p);
+    if (s->slots[j] || !(s->slots[j] = strdup(p))) return;
+    s->used++;
+}
+
+static void path_set_remove(struct path_set *s, const char *p) {
+    if (!s->cap) return;
+    size_t j = path_set_find(s, p);
+    if (s->slots[j]) { free(s->slots[j]); s->slots[j] = PATH_GONE; }
+}
+
+static void path_set_clear(struct path_set *s) {
+    for (size_t i = 0; i < s->cap; ++i)
+        if (s->slots[i] != PATH_GONE) free(s->slots[i]);
+    free(s->slots);
+    memset(s, 0, sizeof(*s));
+}
+
+static void watch_drop(int wd) {
+    if (wd < 0 || (size_t)wd >= watches.cap || !watches.paths[wd]) return;
+    free(watches.paths[wd]);
+    watches.paths[wd] = NULL;
+    --watches.live;
+}
+
+/* Stop watching directory path and everything under it: it left the tree
+ * (or moved within it, where its new name is watched afresh) */
+static void watch_forget(const char *path) {
+    size_t len = strlen(path);
+    for (size_t wd = 0; wd < watches.cap; ++wd) {
+        const char *p = watches.paths[wd];
+        if (!p || strncmp(p, path, len) != 0 || (p[len] != '\0' && p[len] != '/')) continue;
+        inotify_rm_watch(watches.fd, (int)wd);
+        watch_drop((int)wd);
+    }
+}
+
+/* One event line: marker, then the long format of dir/name. Removals, and
+ * additions already gone again by the time we look, get just the name; a
+ * "~" for a vanished file is left to the "-" that follows. Entries the
+ * filters reject are not printed. Returns 1 when the entry exists (a "+"
+ * for the first time) and is shown, or is a directory -R still walks. */
+static int watch_print(char marker, const char *full, unsigned char d_type) {
+    struct dir_ctx dir = { AT_FDCWD, full, &out_stdout };
+    struct entry e = { .name = (char *)full, .d_type = d_type };
+    const char *base = strrchr(full, '/');
+    base = base ? base + 1 : full;
+    int found = 0;
+    if (marker == '+') {
+        if (path_set_has(&watch_added[0], full) || path_set_has(&watch_added[1], full)) return 0;
+        path_set_add(&watch_added[0], full);
+    } else if (marker == '-') {
+        path_set_remove(&watch_added[0], full);
+        path_set_remove(&watch_added[1], full);
+    }
+    if (marker != '-') {
+        struct statx sx;
+        /* quietly: a file may well be gone again by the time we look */
+        found = statx(AT_FDCWD, full, AT_SYMLINK_NOFOLLOW | opts.statx_sync, META_LONG, &sx) == 0;
+        if (!found && marker == '~') return 0;
+        if (found) {
+            statx_to_stat(&sx, &e.st);
+            e.stat_mask = sx.stx_mask | META_LONG;
+        }
+    }
+    if (filters.post) {
+        if (!found && !filter_gone(base, d_type == DT_DIR)) return 0;
+        if (found) {
+            /* the filters match on the bare name; the stat above is reused */
+            struct entry f = e;
+            f.name = (char *)base;
+            enum filter_verdict v = filter_entry(&dir, &f);
+            if (v != FILTER_SHOW) return v == FILTER_DESCEND;
+        }
+    }
+    ob_putc(&out_stdout, marker);
+    ob_putc(&out_stdout, ' ');
+    if (!found) {
+        ob_puts(&out_stdout, full);
+        ob_putc(&out_stdout, '\n');
+    } else {
+        print_long_format(&dir, &e);
+    }
+    return found;
+}
+
+/* A directory that appeared under -R: watch it, then report what is already
+ * inside, since those entries were created before the watch existed */
+static void watch_new_dir(const char *path) {
+    watch_add(path);
+    DIR *dp = opendir(path);
+    if (!dp) return;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        const char *n = de->d_name;
+        if (n[0] == '.' && (!opts.all || n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) continue;
+        if (filters.active && !filter_name(n, de->d_type)) continue;
+        char *sub = join_path(path, n);
+        if (!sub) { perror("asprintf"); continue; }
+        if (watch_print('+', sub, de->d_type) && opts.recursive &&
+            (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN)) {
+            struct stat st;
+            if (de->d_type == DT_DIR || (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode)))
+                watch_new_dir(sub);
+        }
+        free(sub);
+    }
+    closedir(dp);
+}
+
+/* prev is the event handled just before in the same batch: a "~" for the
+ * entry it already reported (touch gives IN_ATTRIB and IN_CLOSE_WRITE, a new
+ * file IN_CREATE then IN_CLOSE_WRITE) is not printed again */
+static void watch_event(const struct inotify_event *ev, const struct inotify_event *prev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "watch: event queue overflowed, some changes were not reported\n");
+        return;
+    }
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF)) { watch_drop(ev->wd); return; }
+    if (ev->wd < 0 || (size_t)ev->wd >= watches.cap || !watches.paths[ev->wd]) return;
+    if (ev->mask & IN_MOVE_SELF) {
+        /* a watched directory whose parent is not watched was moved */
+        char *gone = strdup(watches.paths[ev->wd]);
+        if (gone) watch_forget(gone);
+        free(gone);
+        return;
+    }
+    if (!ev->len) return;
+    if (ev->name[0] == '.' && !opts.all) return;
+    unsigned char d_type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+    if (filters.active && !filter_name(ev->name, d_type)) return;
+
+    char *full = join_path(watches.paths[ev->wd], ev->name);
+    if (!full) { perror("asprintf"); return; }
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watch_print('-', full, d_type);
+        if ((ev->mask & (IN_MOVED_FROM | IN_ISDIR)) == (IN_MOVED_FROM | IN_ISDIR)) watch_forget(full);
+    } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (opts.recursive && (ev->mask & IN_ISDIR)) {
+            if (watch_print('+', full, d_type)) watch_new_dir(full);
+        } else {
+            watch_print('+', full, d_type);
+        }
+    } else if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+        int repeat = prev && prev->wd == ev->wd && prev->len && strcmp(prev->name, ev->name) == 0 &&
+                     (prev->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB));
+        if (!repeat) watch_print('~', full, d_type);
+    }
+    free(full);
+}
+
+/* Report changes until every watched directory is gone (or we are killed);
+ * output is flushed after each batch of events */
+static void watch_loop(void) {
+    _Alignas(struct inotify_event) char buf[64 * 1024];
+    ob_flush(&out_stdout);
+    while (watches.live > 0) {
+        ssize_t n = read(watches.fd, buf, sizeof(buf));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read inotify");
+            break;
+        }
+        /* whatever follows within a few ms joins this batch, so the events
+         * of one operation end up next to each other and print once */
+        struct pollfd pfd = { watches.fd, POLLIN, 0 };
+        while (sizeof(buf) - (size_t)n >= sizeof(struct inotify_event) + NAME_MAX + 1 &&
+               poll(&pfd, 1, WATCH_COALESCE_MS) == 1) {
+            ssize_t more = read(watches.fd, buf + n, sizeof(buf) - (size_t)n);
+            if (more <= 0) break;
+            n += more;
+        }
+        /* files created since startup must not count as "in the future" */
+        opts.now = time(NULL);
+        const struct inotify_event *prev = NULL;
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            watch_event(ev, prev);
+            prev = ev;
+            p += sizeof(*ev) + ev->len;
+        }
+        ob_flush(&out_stdout);
+        path_set_clear(&watch_added[1]);
+        watch_added[1] = watch_added[0];
+        memset(&watch_added[0], 0, sizeof(watch_added[0]));
+    }
+    path_set_clear(&watch_added[0]);
+    path_set_clear(&watch_added[1]);
+    for (size_t i = 0; i < watches.cap; ++i) free(watches.paths[i]);
+    free(watches.paths);
+    close(watches.fd);
+}
+
+/* ---------- disk usage (--du) ---------- */
+static void du_free(void) {
+    free(du_links.slots);
+}
+
+static uint64_t du_hash(uint64_t dev, uint64_t ino) {
+    return (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ull;
+}
+
+/* 1 the first time (dev, ino) is offered, 0 after that. Also 1 when the
+ * set cannot grow: counting a file twice beats not counting it. */
+static int du_first_link(uint64_t dev, uint64_t ino) {
+    struct inode_set *s = &du_links;
+    if (2 * (s->count + 1) > s->cap) {
+        size_t ncap = s->cap ? s->cap * 2 : 64;
+        struct inode_key *slots = calloc(ncap, sizeof(*slots));
+        if (!slots) return 1;
+        for (size_t i = 0; i < s->cap; ++i) {
+            struct inode_key k = s->slots[i];
+            if (k.ino == 0) continue;
+            size_t j = du_hash(k.dev, k.ino) & (ncap - 1);
+            while (slots[j].ino) j = (j + 1) & (ncap - 1);
+            slots[j] = k;
+        }
+        free(s->slots);
+        s->slots = slots;
+        s->cap = ncap;
+    }
+    size_t j = du_hash(dev, ino) & (s->cap - 1);
+    while (s->slots[j].ino && (s->slots[j].ino != ino || s->slots[j].dev != dev))
+        j = (j + 1) & (s->cap - 1);
+    if (s->slots[j].ino) return 0;
+    s->slots[j].dev = dev;
+    s->slots[j].ino = ino;
+    s->count++;
+    return 1;
+}
+
+/* Blocks and bytes of the directory itself and of its entries other than
+ * subdirectories, which their own nodes count. Files with several links
+ * are only noted in n->links, with their place among the subdirectories. */
+static void du_count(const struct dir_ctx *dir, struct listing *ls, struct dir_node *n) {
+    struct stat dst;
+    if (fstat(dir->fd, &dst) == 0) {
+        n->du_blocks += (uint64_t)dst.st_blocks;
+        n->du_bytes += (uint64_t)dst.st_size;
+    }
+    if (opts.uring) stat_ring_fill(dir, ls);
+    size_t ndirs = 0;
+    for (size_t i = 0; i < ls->count; ++i) {
+        struct entry *e = ls->list[i];
+        const char *nm = e->name;
+        if (nm[0] == '.' && (nm[1] == '\0' || (nm[1] == '.' && nm[2] == '\0'))) continue;
+        if (e->d_type == DT_DIR) { ++ndirs; continue; }
+        struct stat *st = entry_stat(dir, e, META_DU);
+        if (!st) continue;
+        if (S_ISDIR(st->st_mode)) { ++ndirs; continue; }
+        if (st->st_nlink > 1) {
+            if (n->nlinks == n->caplinks) {
+                size_t ncap = n->caplinks ? n->caplinks * 2 : 8;
+                struct du_link *tmp = realloc(n->links, ncap * sizeof(*tmp));
+                if (!tmp) { perror("realloc"); continue; }
+                n->links = tmp; n->caplinks = ncap;
+            }
+            n->links[n->nlinks++] = (struct du_link){ (uint64_t)st->st_dev, (uint64_t)st->st_ino,
+                                                      (uint64_t)st->st_blocks, (uint64_t)st->st_size, ndirs };
+            continue;
+        }
+        n->du_blocks += (uint64_t)st->st_blocks;
+        n->du_bytes += (uint64_t)st->st_size;
+    }
+}
+
+/* Charge n's multiply linked files listed ahead of child k (all remaining
+ * ones for k == nchildren) that the walk has not met before */
+static void du_charge_links(struct dir_node *n, size_t *next, size_t k) {
+    for (; *next < n->nlinks && n->links[*next].before <= k; ++*next) {
+        const struct du_link *l = &n->links[*next];
+        if (!du_first_link(l->dev, l->ino)) continue;
+        n->du_blocks += l->blocks;
+        n->du_bytes += l->bytes;
+    }
+}
+
+/* One du line for a finished subtree: KiB used, with -l the apparent size
+ * in bytes, then the path */
+static void du_print(struct outbuf *ob, const struct dir_node *n) {
+    ob_num(ob, (long long)((n->du_blocks * 512 + 1023) / 1024), 0);
+    ob_putc(ob, '\t');
+    if (opts.long_format) {
+        ob_num(ob, (long long)n->du_bytes, 0);
+        ob_putc(ob, '\t');
+    }
+    ob_puts(ob, n->path);
+    ob_putc(ob, '\n');
+}
+
+/* ---------- parallel recursive walk (-R -j N) ---------- */
+static void dq_init(struct wsdeque *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->items = NULL;
+    d->head = d->tail = d->cap = 0;
+}
+
+static void dq_destroy(struct wsdeque *d) {
+    pthread_mutex_destroy(&d->lock);
+    free(d->items);
+}
+
+static int dq_push(struct wsdeque *d, struct dir_node *n) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head, (d->tail - d->head) * sizeof(*d->items));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t ncap = d->cap ? d->cap * 2 : 64;
+            struct dir_node **tmp = realloc(d->items, ncap * sizeof(*d->items));
+            if (!tmp) { pthread_mutex_unlock(&d->lock); return -1; }
+            d->items = tmp;
+            d->cap = ncap;
+        }
+    }
+    d->items[d->tail++] = n;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+/* Owner side: newest node first, so a worker tends to stay in its subtree */
+static struct dir_node *dq_pop(struct wsdeque *d) {
+    struct dir_node *n = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        n = d->items[--d->tail];
+        if (d->tail == d->head) d->head = d->tail = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+/* Thief side: oldest node, which is usually the biggest remaining subtree */
+static struct dir_node *dq_steal(struct wsdeque *d) {
+    struct dir_node *n = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        n = d->items[d->head++];
+        if (d->tail == d->head) d->head = d->tail = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+static struct dir_node *node_new(struct dir_node *parent, const char *name, char *path) {
+    struct dir_node *n = calloc(1, sizeof(*n));
+    if (!n) return NULL;
+    n->name = strdup(name);
+    if (!n->name) { free(n); return NULL; }
+    n->parent = parent;
+    n->path = path;
+    n->fd = -1;
+    atomic_init(&n->fd_refs, 0);
+    return n;
+}
+
+static void node_fd_release(struct dir_node *n) {
+    if (atomic_fetch_sub(&n->fd_refs, 1) == 1) close(n->fd);
+}
+
+static void walk_process(struct worker *w, struct dir_node *n);
+
+static void pool_push(struct worker *w, struct dir_node *n) {
+    struct walk_pool *pool = w->pool;
+    atomic_fetch_add(&pool->queued, 1);
+    if (dq_push(&w->dq, n) == -1) {
+        /* no room to queue it: do the work right here instead */
+        atomic_fetch_sub(&pool->queued, 1);
+        walk_process(w, n);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static struct dir_node *pool_take(struct worker *w) {
+    struct walk_pool *pool = w->pool;
+    struct dir_node *n = dq_pop(&w->dq);
+    for (int i = 1; !n && i < pool->nworkers; ++i)
+        n = dq_steal(&pool->workers[(w->id + i) % pool->nworkers].dq);
+    if (n) atomic_fetch_sub(&pool->queued, 1);
+    return n;
+}
+
+/* Open, read, sort and render one directory, then queue its subdirectories */
+static void walk_process(struct worker *w, struct dir_node *n) {
+    struct walk_pool *pool = w->pool;
+    int at_fd = n->parent ? n->parent->fd : AT_FDCWD;
+    n->fd = openat(at_fd, n->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int err = errno;
+    if (n->fd == -1 && opts.du) {
+        /* an unreadable directory still takes up its own blocks */
+        struct stat dst;
+        if (fstatat(at_fd, n->name, &dst, AT_SYMLINK_NOFOLLOW) == 0) {
+            n->du_blocks += (uint64_t)dst.st_blocks;
+            n->du_bytes += (uint64_t)dst.st_size;
+        } else {
+            n->failed = 1;
+        }
+    }
+    if (n->parent) node_fd_release(n->parent);
+
+    n->out.fd = -1;
+    if (n->fd == -1) {
+        fprintf(stderr, "Cannot open directory '%s': %s\n", n->path, strerror(err));
+    } else {
+        struct arena_mark mark = arena_mark(&w->arena);
+        struct listing ls = { .arena = &w->arena };
+        struct dir_ctx dir = { n->fd, n->path, &n->out };
+        if (read_listing(&dir, &ls) == 0) {
+            if (opts.du) du_count(&dir, &ls, n);
+            else print_listing(&dir, &ls);
+
+            /* subdirectories: the listed ones, then those --type hid */
+            size_t nall = ls.count + ls.ndescend, ndirs = 0;
+            for (size_t i = 0; i < nall; ++i)
+                if (is_subdir(&dir, i < ls.count ? ls.list[i] : ls.descend[i - ls.count])) ++ndirs;
+            n->children = ndirs ? malloc(ndirs * sizeof(*n->children)) : NULL;
+            if (ndirs && !n->children) perror("malloc");
+            for (size_t i = 0; n->children && i < nall; ++i) {
+                struct entry *e = i < ls.count ? ls.list[i] : ls.descend[i - ls.count];
+                if (!is_subdir(&dir, e)) continue;
+                char *sub = join_path(n->path, e->name);
+                struct dir_node *c = sub ? node_new(n, e->name, sub) : NULL;
+                if (!c) { perror("malloc"); free(sub); continue; }
+                n->children[n->nchildren++] = c;
+            }
+        }
+        arena_release(&w->arena, mark);
+    }
+
+    if (n->fd != -1) atomic_store(&n->fd_refs, (int)n->nchildren + 1);
+
+    /* pushed last-first so this worker pops them in listing order */
+    for (size_t i = n->nchildren; i-- > 0; )
+        pool_push(w, n->children[i]);
+    if (n->fd != -1) node_fd_release(n);
+
+    /* last touch: once done is set the emitting thread may free n */
+    pthread_mutex_lock(&pool->lock);
+    n->done = 1;
+    pthread_cond_broadcast(&pool->done_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct walk_pool *pool = w->pool;
+    for (;;) {
+        struct dir_node *n = pool_take(w);
+        if (n) { walk_process(w, n); continue; }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && atomic_load(&pool->queued) == 0)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        int stop = pool->shutdown;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+    stat_ring_teardown();
+    stats_merge();
+    return NULL;
+}
+
+/* Write a node's buffered listing, then its subtree, exactly where the
+ * serial walk would have printed them; nodes are freed once written.
+ * With --du the children's totals are folded in and the node is printed
+ * after its subtree instead. */
+static void walk_emit(struct walk_pool *pool, struct dir_node *n) {
+    pthread_mutex_lock(&pool->lock);
+    while (!n->done) pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    ob_write(&out_stdout, n->out.buf, n->out.len);
+    free(n->out.buf);
+    size_t next_link = 0;
+    for (size_t i = 0; i < n->nchildren; ++i) {
+        if (opts.du) du_charge_links(n, &next_link, i);
+        print_separator(&out_stdout);
+        walk_emit(pool, n->children[i]);
+    }
+    if (opts.du) {
+        du_charge_links(n, &next_link, n->nchildren);
+        if (!n->failed && (!opts.du_summary || !n->parent)) du_print(&out_stdout, n);
+        if (n->parent) {
+            n->parent->du_blocks += n->du_blocks;
+            n->parent->du_bytes += n->du_bytes;
+        }
+    }
+    free(n->children);
+    free(n->links);
+    free(n->name);
+    free(n->path);
+    free(n);
+}
+
+/* -R with -j N: same output as do_ls, produced by N worker threads.
+ * --du always walks here, with a single worker unless -j says more. */
+void do_ls_parallel(const char *path) {
+    struct walk_pool pool;
+    pool.nworkers = opts.jobs;
+    pool.workers = calloc((size_t)pool.nworkers, sizeof(struct worker));
+    char *root_path = strdup(path);
+    struct dir_node *root = root_path ? node_new(NULL, path, root_path) : NULL;
+    if (!pool.workers || !root) {
+        perror("malloc");
+        free(pool.workers);
+        free(root_path);
+        free(root);
+        do_ls(AT_FDCWD, path, path);
+        return;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cv, NULL);
+    pthread_cond_init(&pool.done_cv, NULL);
+    atomic_init(&pool.queued, 0);
+    pool.shutdown = 0;
+
+    for (int i = 0; i < pool.nworkers; ++i) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+        dq_init(&pool.workers[i].dq);
+    }
+    int started = 0;
+    if (dq_push(&pool.workers[0].dq, root) == 0) {
+        atomic_store(&pool.queued, 1);
+        for (int i = 0; i < pool.nworkers; ++i) {
+            if (pthread_create(&pool.workers[i].tid, NULL, worker_main, &pool.workers[i]) == 0) {
+                pool.workers[i].started = 1;
+                ++started;
+            }
+        }
+    }
+    if (started == 0 && opts.du) {
+        /* do the workers' job here, then sum up as usual */
+        fprintf(stderr, "%s: could not start worker threads, walking serially\n", path);
+        for (struct dir_node *n; (n = pool_take(&pool.workers[0])) != NULL; )
+            walk_process(&pool.workers[0], n);
+        walk_emit(&pool, root);
+    } else if (started == 0) {
+        /* no threads to hand the walk to: fall back to the serial walk */
+        fprintf(stderr, "%s: could not start worker threads, listing serially\n", path);
+        dq_pop(&pool.workers[0].dq);
+        free(root->name); free(root->path); free(root);
+        do_ls(AT_FDCWD, path, path);
+    } else {
+        walk_emit(&pool, root);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work_cv);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.nworkers; ++i)
+        if (pool.workers[i].started) pthread_join(pool.workers[i].tid, NULL);
+    for (int i = 0; i < pool.nworkers; ++i) {
+        dq_destroy(&pool.workers[i].dq);
+        arena_destroy(&pool.workers[i].arena);
+    }
+    pthread_cond_destroy(&pool.done_cv);
+    pthread_cond_destroy(&pool.work_cv);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.workers);
+}
+
+/* ---------- uid/gid name cache ---------- */
+/* Ask NSS for the name of uid/gid id; NULL when there is none */
+static char *nss_lookup_name(int is_group, unsigned id) {
+    long sz = sysconf(is_group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+    size_t bufsz = sz > 0 ? (size_t)sz : 1024;
+    char *name = NULL;
+    for (;;) {
+        char *buf = malloc(bufsz);
+        if (!buf) return NULL;
+        int rc;
+        if (is_group) {
+            struct group grp, *gr = NULL;
+            rc = getgrgid_r((gid_t)id, &grp, buf, bufsz, &gr);
+            if (rc == 0 && gr) name = strdup(gr->gr_name);
+        } else {
+            struct passwd pwd, *pw = NULL;
+            rc = getpwuid_r((uid_t)id, &pwd, buf, bufsz, &pw);
+            if (rc == 0 && pw) name = strdup(pw->pw_name);
+        }
+        free(buf);
+        if (rc != ERANGE || bufsz >= (1u << 20)) break;
+        bufsz *= 2;   /* e.g. a group with a very long member list */
+    }
+    return name;
+}
+
+/* Name for id, asking NSS only the first time an id is seen in this run.
+ * The returned string stays valid until name_cache_free. */
+static const char *cached_name(struct name_cache *c, unsigned id) {
+    unsigned b = (id * 2654435761u) % NAME_CACHE_BUCKETS;
+    pthread_mutex_lock(&c->lock);
+    for (struct name_cache_ent *p = c->buckets[b]; p; p = p->next) {
+        if (p->id == id) {
+            pthread_mutex_unlock(&c->lock);
+            return p->name;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* not under the lock: a slow LDAP/SSSD round trip must not stall other workers */
+    struct stats_span span = stats_begin();
+    char *name = nss_lookup_name(c->is_group, id);
+    stats_end(PH_NSS, span);
+
+    pthread_mutex_lock(&c->lock);
+    for (struct name_cache_ent *p = c->buckets[b]; p; p = p->next) {
+        if (p->id == id) {   /* another worker got there first */
+            pthread_mutex_unlock(&c->lock);
+            free(name);
+            return p->name;
+        }
+    }
+    struct name_cache_ent *ent = malloc(sizeof(*ent));
+    if (!ent) {
+        pthread_mutex_unlock(&c->lock);
+        free(name);
+        return NULL;
+    }
+    ent->id = id;
+    ent->name = name;
+    ent->next = c->buckets[b];
+    c->buckets[b] = ent;
+    pthread_mutex_unlock(&c->lock);
+    return name;
+}
+
+static void name_cache_free(struct name_cache *c) {
+    for (int b = 0; b < NAME_CACHE_BUCKETS; ++b) {
+        while (c->buckets[b]) {
+            struct name_cache_ent *next = c->buckets[b]->next;
+            free(c->buckets[b]->name);
+            free(c->buckets[b]);
+            c->buckets[b] = next;
+        }
+    }
+}
+
+/* ---------- cached timestamp formatting ---------- */
+static _Thread_local struct day_slot time_cache[TIME_CACHE_SLOTS];
+
+/* Fill slot with the local day containing t; 0 on success */
+static int day_slot_fill(struct day_slot *slot, time_t t) {
+    struct tm tm, tm_start, tm_last;
+    if (!localtime_r(&t, &tm)) return -1;
+    slot->start = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+    slot->end = slot->start + 86400;
+    time_t last = slot->end - 1;
+    /* HH:MM can only be derived from the offset into the day when the UTC
+     * offset is the same all day long (not a DST switch day) */
+    slot->uniform = localtime_r(&slot->start, &tm_start) && localtime_r(&last, &tm_last)
+                    && tm_start.tm_gmtoff == tm.tm_gmtoff && tm_last.tm_gmtoff == tm.tm_gmtoff
+                    && tm_last.tm_mday == tm.tm_mday;
+    strftime(slot->prefix, sizeof(slot->prefix), "%b %e ", &tm);
+    snprintf(slot->year, sizeof(slot->year), "%d", tm.tm_year + 1900);
+    slot->valid = 1;
+    return 0;
+}
+
+/* Format t like ls -l: "Mon dd HH:MM" for recent files, "Mon dd  YYYY"
+ * otherwise. Returns the length written to buf. */
+static size_t format_mtime(time_t t, char *buf, size_t bufsz) {
+    int recent = t > opts.now - SIX_MONTHS && t <= opts.now;
+    long long local = (long long)t + opts.tz_offset;
+    long long day = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+    struct day_slot *slot = &time_cache[(unsigned long long)day % TIME_CACHE_SLOTS];
+
+    if (!slot->valid || t < slot->start || t >= slot->end) {
+        if (day_slot_fill(slot, t) == -1) { slot->valid = 0; return (size_t)snprintf(buf, bufsz, "???"); }
+    }
+    if (!slot->uniform) {
+        struct tm tm;
+        if (!localtime_r(&t, &tm)) return (size_t)snprintf(buf, bufsz, "???");
+        return strftime(buf, bufsz, recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+    }
+    if (!recent) return (size_t)snprintf(buf, bufsz, "%s %s", slot->prefix, slot->year);
+    long secs = (long)(t - slot->start);
+    int hh = (int)(secs / 3600), mm = (int)(secs / 60 % 60);
+    size_t n = strlen(slot->prefix);
+    if (n + 6 > bufsz) return 0;
+    memcpy(buf, slot->prefix, n);
+    buf[n++] = (char)('0' + hh / 10); buf[n++] = (char)('0' + hh % 10);
+    buf[n++] = ':';
+    buf[n++] = (char)('0' + mm / 10); buf[n++] = (char)('0' + mm % 10);
+    buf[n] = '\0';
+    return n;
+}
+
+/* ---------- long listing ---------- */
+void print_long_format(const struct dir_ctx *dir, struct entry *e) {
+    struct stat *st = entry_stat(dir, e, META_LONG);
+    if (!st) return;
+
+    /* file type */
+    char ft = '-';
+    if (S_ISDIR(st->st_mode)) ft = 'd';
+    else if (S_ISLNK(st->st_mode)) ft = 'l';
+    else if (S_ISCHR(st->st_mode)) ft = 'c';
+    else if (S_ISBLK(st->st_mode)) ft = 'b';
+    else if (S_ISFIFO(st->st_mode)) ft = 'p';
+    else if (S_ISSOCK(st->st_mode)) ft = 's';
+
+    /* permissions */
+    char perm[11] = {0};
+    perm[0] = ft;
+    perm[1] = (st->st_mode & S_IRUSR) ? 'r' : '-'; perm[2] = (st->st_mode & S_IWUSR) ? 'w' : '-'; perm[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
+    perm[4] = (st->st_mode & S_IRGRP) ? 'r' : '-'; perm[5] = (st->st_mode & S_IWGRP) ? 'w' : '-'; perm[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
+    perm[7] = (st->st_mode & S_IROTH) ? 'r' : '-'; perm[8] = (st->st_mode & S_IWOTH) ? 'w' : '-'; perm[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
+
+    const char *owner = cached_name(&user_cache, (unsigned)st->st_uid);
+    const char *group = cached_name(&group_cache, (unsigned)st->st_gid);
+    char timebuf[64];
+    size_t tlen = format_mtime(st->st_mtime, timebuf, sizeof(timebuf));
+
+    /* same layout as "%s %3ld %-8s %-8s %8ld %s ", built without stdio */
+    struct outbuf *ob = dir->out;
+    if (!owner) owner = "?";
+    if (!group) group = "?";
+    size_t olen = strlen(owner), glen = strlen(group);
+    ob_write(ob, perm, 10);
+    ob_putc(ob, ' ');
+    ob_num(ob, (long long)st->st_nlink, 3);
+    ob_putc(ob, ' ');
+    ob_write(ob, owner, olen);
+    ob_pad(ob, olen < 8 ? 8 - olen : 0);
+    ob_putc(ob, ' ');
+    ob_write(ob, group, glen);
+    ob_pad(ob, glen < 8 ? 8 - glen : 0);
+    ob_putc(ob, ' ');
+    ob_num(ob, (long long)st->st_size, 8);
+    ob_putc(ob, ' ');
+    ob_write(ob, timebuf, tlen);
+    ob_putc(ob, ' ');
+    /* colorized name printed here, reusing the stat above */
+    color_print_name(dir, e);
+    ob_putc(ob, '\n');
+}
+
+/* ---------- name scanning ---------- */
+/* What the printers need to know about a name, found in one pass */
+struct name_info {
+    size_t len;     /* bytes before the NUL */
+    size_t dot;     /* offset of the last '.', len if there is none */
+    int ascii;      /* no byte >= 0x80, so the display width is len */
+};
+
+static void scan_name_scalar(const char *s, struct name_info *ni) {
+    size_t i = 0, dot = SIZE_MAX;
+    unsigned char high = 0;
+    for (; s[i]; ++i) {
+        if (s[i] == '.') dot = i;
+        high |= (unsigned char)s[i];
+    }
+    ni->len = i;
+    ni->dot = dot == SIZE_MAX ? i : dot;
+    ni->ascii = !(high & 0x80);
+}
+
+#ifdef HAVE_X86_SIMD
+/* The vector scans read whole aligned blocks, which never cross a page but
+ * may run past the NUL; the bytes outside the name are masked off. That is
+ * safe, but not something ASan can see, hence no_sanitize_address. */
+__attribute__((no_sanitize_address))
+static void scan_name_sse2(const char *s, struct name_info *ni) {
+    const __m128i zero = _mm_setzero_si128(), dots = _mm_set1_epi8('.');
+    size_t off = (uintptr_t)s & 15;
+    const char *p = s - off;
+    unsigned keep = 0xffffu << off, high = 0;
+    ptrdiff_t dot = -1;
+    for (;; p += 16, keep = 0xffffu) {
+        __m128i v = _mm_load_si128((const __m128i *)p);
+        unsigned z = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & keep;
+        keep &= (z & -z) - 1;    /* only the bytes before the NUL; all of them if none */
+        unsigned d = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dots)) & keep;
+        if (d) dot = (p - s) + 31 - __builtin_clz(d);
+        high |= (unsigned)_mm_movemask_epi8(v) & keep;
+        if (z) { ni->len = (size_t)((p - s) + __builtin_ctz(z)); break; }
+    }
+    ni->dot = dot < 0 ? ni->len : (size_t)dot;
+    ni->ascii = !high;
+}
+
+__attribute__((no_sanitize_address, target("avx2")))
+static void scan_name_avx2(const char *s, struct name_info *ni) {
+    const __m256i zero = _mm256_setzero_si256(), dots = _mm256_set1_epi8('.');
+    size_t off = (uintptr_t)s & 31;
+    const char *p = s - off;
+    unsigned keep = 0xffffffffu << off, high = 0;
+    ptrdiff_t dot = -1;
+    for (;; p += 32, keep = 0xffffffffu) {
+        __m256i v = _mm256_load_si256((const __m256i *)p);
+        unsigned z = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & keep;
+        keep &= (z & -z) - 1;
+        unsigned d = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dots)) & keep;
+        if (d) dot = (p - s) + 31 - __builtin_clz(d);
+        high |= (unsigned)_mm256_movemask_epi8(v) & keep;
+        if (z) { ni->len = (size_t)((p - s) + __builtin_ctz(z)); break; }
+    }
+    ni->dot = dot < 0 ? ni->len : (size_t)dot;
+    ni->ascii = !high;
+}
+#endif
+
+/* Chosen once in main, before any worker thread starts */
+static void (*scan_name)(const char *s, struct name_info *ni) = scan_name_scalar;
+
+static void scan_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    scan_name = __builtin_cpu_supports("avx2") ? scan_name_avx2 : scan_name_sse2;
+#endif
+}
+
+/* Terminal columns of a name that is not plain ASCII, decoded in the
+ * locale's encoding; each byte of an invalid sequence and each
+ * non-printable character takes one column */
+static size_t mb_width(const char *s, size_t len) {
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+    size_t w = 0;
+    while (len > 0) {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, s, len, &ps);
+        if (n == (size_t)-1 || n == (size_t)-2) {
+            memset(&ps, 0, sizeof(ps));
+            ++w; ++s; --len;
+            continue;
+        }
+        if (n == 0) n = 1;
+        int cw = wcwidth(wc);
+        w += cw < 0 ? 1 : (size_t)cw;
+        s += n; len -= n;
+    }
+    return w;
+}
+
+/* Display widths of a batch of names: one vector pass each, and the
+ * multibyte decoder only for the names that are not plain ASCII. After sorting, the
+ * entries and names are scattered over the arena and mostly not in cache,
+ * so both are prefetched a few names ahead; otherwise the scan stalls on
+ * every name in turn instead of overlapping the misses. */
+#define SCAN_PREFETCH 8
+
+static void name_widths(struct entry **list, size_t count, size_t *width) {
+    struct name_info ni;
+    for (size_t i = 0; i < count; ++i) {
+        if (i + 2 * SCAN_PREFETCH < count) __builtin_prefetch(list[i + 2 * SCAN_PREFETCH]);
+        if (i + SCAN_PREFETCH < count) __builtin_prefetch(list[i + SCAN_PREFETCH]->name);
+        scan_name(list[i]->name, &ni);
+        width[i] = ni.ascii ? ni.len : mb_width(list[i]->name, ni.len);
+    }
+}
+
+/* ---------- color selection and printing ---------- */
+static const char *const color_keys[CK_COUNT] = { "fi", "di", "ln", "pi", "so", "bd", "cd", "ex" };
+
+/* "\033[" sgr "m", or nothing for an empty sgr */
+static int color_render(struct color_seq *c, const char *sgr, size_t n) {
+    char *esc = NULL;
+    if (n && (esc = malloc(n + 3)) == NULL) return -1;
+    if (n) {
+        memcpy(esc, "\033[", 2);
+        memcpy(esc + 2, sgr, n);
+        esc[n + 2] = 'm';
+    }
+    free(c->esc);
+    c->esc = esc;
+    c->len = n ? n + 3 : 0;
+    return 0;
+}
+
+static struct color_ext *color_ext_slot(struct color_ext *tab, size_t cap, const char *suffix, size_t len, uint64_t h) {
+    size_t i = h & (cap - 1);
+    while (tab[i].suffix && (tab[i].hash != h || tab[i].len != len || memcmp(tab[i].suffix, suffix, len) != 0))
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+/* Colour for names ending in suffix; a later entry for the same suffix wins */
+static void color_add_suffix(const char *suffix, size_t len, const char *sgr, size_t n) {
+    struct color_ext *slot = NULL;
+    if (len == 0) return;
+    int hashed = suffix[0] == '.' && !memchr(suffix + 1, '.', len - 1);
+    if (hashed) {
+        if (2 * (colors.ext_count + 1) > colors.ext_cap) {
+            size_t ncap = colors.ext_cap ? colors.ext_cap * 2 : 64;
+            struct color_ext *tab = calloc(ncap, sizeof(*tab));
+            if (!tab) { perror("calloc"); return; }
+            for (size_t i = 0; i < colors.ext_cap; ++i)
+                if (colors.ext[i].suffix)
+                    *color_ext_slot(tab, ncap, colors.ext[i].suffix, colors.ext[i].len, colors.ext[i].hash) = colors.ext[i];
+            free(colors.ext);
+            colors.ext = tab;
+            colors.ext_cap = ncap;
+        }
+        uint64_t h = index_hash(suffix, len);
+        slot = color_ext_slot(colors.ext, colors.ext_cap, suffix, len, h);
+        slot->hash = h;
+    } else {
+        for (size_t i = 0; i < colors.nother && !slot; ++i)
+            if (colors.other[i].len == len && memcmp(colors.other[i].suffix, suffix, len) == 0) slot = &colors.other[i];
+        if (!slot) {
+            struct color_ext *tmp = realloc(colors.other, (colors.nother + 1) * sizeof(*tmp));
+            if (!tmp) { perror("realloc"); return; }
+            colors.other = tmp;
+            slot = memset(&colors.other[colors.nother++], 0, sizeof(*slot));
+        }
+    }
+    if (!slot->suffix) {
+        if ((slot->suffix = strndup(suffix, len)) == NULL) {
+            perror("strndup");
+            if (!hashed) colors.nother--;
+            return;
+        }
+        slot->len = len;
+        if (hashed) colors.ext_count++;
+    }
+    if (color_render(&slot->seq, sgr, n) == -1) perror("malloc");
+}
+
+/* Apply one "key=sgr" item of LS_COLORS; unknown keys are ignored */
+static void color_apply(const char *item, size_t len) {
+    const char *eq = memchr(item, '=', len);
+    if (!eq) return;
+    size_t klen = (size_t)(eq - item), n = len - klen - 1;
+    if (klen > 1 && item[0] == '*') {
+        color_add_suffix(item + 1, klen - 1, eq + 1, n);
+        return;
+    }
+    for (int k = 0; k < CK_COUNT; ++k)
+        if (klen == 2 && memcmp(item, color_keys[k], 2) == 0 && color_render(&colors.type[k], eq + 1, n) == -1)
+            perror("malloc");
+}
+
+/* The built-in scheme, then whatever LS_COLORS changes on top of it */
+static void color_init(const char *ls_colors) {
+    static const char defaults[] = "di=0;34:ln=1;35:ex=0;32:pi=7:so=7:bd=7:cd=7:"
+                                   "*.tar=0;31:*.gz=0;31:*.zip=0;31";
+    for (int pass = 0; pass < 2; ++pass) {
+        const char *p = pass == 0 ? defaults : ls_colors;
+        while (p && *p) {
+            const char *end = strchr(p, ':');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            color_apply(p, len);
+            p = end ? end + 1 : NULL;
+        }
+    }
+}
+
+static void color_free(void) {
+    for (int k = 0; k < CK_COUNT; ++k) free(colors.type[k].esc);
+    for (size_t i = 0; i < colors.ext_cap; ++i) { free(colors.ext[i].suffix); free(colors.ext[i].seq.esc); }
+    for (size_t i = 0; i < colors.nother; ++i) { free(colors.other[i].suffix); free(colors.other[i].seq.esc); }
+    free(colors.ext);
+    free(colors.other);
+}
+
+/* Longest suffix entry matching name, NULL if none */
+static const struct color_seq *color_suffix(const char *name) {
+    const struct color_ext *best = NULL;
+    struct name_info ni;
+    scan_name(name, &ni);
+    if (ni.dot < ni.len && colors.ext_count) {
+        const char *dot = name + ni.dot;
+        size_t len = ni.len - ni.dot;
+        const struct color_ext *x = color_ext_slot(colors.ext, colors.ext_cap, dot, len, index_hash(dot, len));
+        if (x->suffix) best = x;
+    }
+    if (colors.nother) {
+        size_t nlen = ni.len;
+        for (size_t i = 0; i < colors.nother; ++i) {
+            const struct color_ext *x = &colors.other[i];
+            if (x->len <= nlen && (!best || x->len > best->len) && memcmp(name + nlen - x->len, x->suffix, x->len) == 0)
+                best = x;
+        }
+    }
+    return best ? &best->seq : NULL;
+}
+
+/* Colour of an entry: by file type, and for regular files by the exec bits,
+ * then by suffix. Only regular files are stat'ed, and only if ex is coloured. */
+static const struct color_seq *color_of(const struct dir_ctx *dir, struct entry *e) {
+    switch (entry_type(dir, e)) {
+        case S_IFLNK:  return &colors.type[CK_LINK];
+        case S_IFDIR:  return &colors.type[CK_DIR];
+        case S_IFIFO:  return &colors.type[CK_FIFO];
+        case S_IFSOCK: return &colors.type[CK_SOCK];
+        case S_IFBLK:  return &colors.type[CK_BLK];
+        case S_IFCHR:  return &colors.type[CK_CHR];
+        case S_IFREG:  break;
+        default:       return NULL;   /* type unknown after a failed stat */
+    }
+    if (colors.type[CK_EXEC].len) {
+        struct stat *st = entry_stat(dir, e, META_COLOR);
+        if (st && (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) return &colors.type[CK_EXEC];
+    }
+    const struct color_seq *c = color_suffix(e->name);
+    return c ? c : &colors.type[CK_FILE];
+}
+
+/* name between its escape and the reset sequence, reserved as one append */
+static void put_colored(struct outbuf *ob, const struct color_seq *c, const char *name) {
+    size_t n = strlen(name), rlen = sizeof(CLR_RESET) - 1;
+    if (ob_reserve(ob, c->len + n + rlen) == -1) return;
+    char *p = ob->buf + ob->len;
+    memcpy(p, c->esc, c->len);
+    memcpy(p + c->len, name, n);
+    memcpy(p + c->len + n, CLR_RESET, rlen);
+    ob->len += c->len + n + rlen;
+}
+
+void color_print_name(const struct dir_ctx *dir, struct entry *e) {
+    const struct color_seq *c = opts.color ? color_of(dir, e) : NULL;
+    if (c && c->len) put_colored(dir->out, c, e->name);
+    else ob_puts(dir->out, e->name);
+}
+
+/* ---------- column layout ---------- */
+#define COL_SPACING 2
+#define MIN_COLUMN_WIDTH (1 + COL_SPACING)
+
+/*
+ * GNU-style variable-width grid: each column is as wide as its own longest
+ * name (plus COL_SPACING, except the last), and we pick the largest column
+ * count whose rows fit strictly inside term_width. Fills widths[0..cols-1]
+ * and returns cols; widths must hold count entries at most.
+ */
+static size_t layout_columns(const size_t *len, size_t count, int term_width,
+                             int across, size_t *widths) {
+    size_t max_cols = term_width > 0 ? (size_t)term_width / MIN_COLUMN_WIDTH : 1;
+    if (max_cols < 1) max_cols = 1;
+    if (max_cols > count) max_cols = count;
+
+    for (size_t cols = max_cols; cols > 1; --cols) {
+        size_t rows = (count + cols - 1) / cols;
+        /* a down layout may not need every column it was given */
+        if (!across && (count + rows - 1) / rows != cols) continue;
+        memset(widths, 0, cols * sizeof(*widths));
+        size_t line = 0;
+        int fits = 1;
+        for (size_t i = 0; i < count && fits; ++i) {
+            size_t c = across ? i % cols : i / rows;
+            size_t w = len[i] + (c == cols - 1 ? 0 : COL_SPACING);
+            if (w > widths[c]) {
+                line += w - widths[c];
+                widths[c] = w;
+                if (line >= (size_t)term_width) fits = 0;
+            }
+        }
+        if (fits) return cols;
+    }
+    widths[0] = 0;
+    return 1;
+}
+
+/* Lay out and emit one block of names; len (display widths) and widths
+ * hold count entries */
+static void print_block(struct entry **list, size_t count, int term_width, const struct dir_ctx *dir,
+                        int across, size_t *len, size_t *widths) {
+    name_widths(list, count, len);
+
+    size_t cols = layout_columns(len, count, term_width, across, widths);
+    size_t rows = (count + cols - 1) / cols;
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            size_t idx = across ? r * cols + c : c * rows + r;
+            if (idx >= count) break;
+            color_print_name(dir, list[idx]);
+            size_t next = across ? idx + 1 : idx + rows;
+            /* no trailing blanks after the last name on a row */
+            if (c + 1 < cols && next < count)
+                ob_pad(dir->out, widths[c] - len[idx]);
+        }
+        ob_putc(dir->out, '\n');
+    }
+}
+
+/* Lay out and emit list; across = 1 for -x, 0 for columns. With --chunk
+ * every opts.chunk entries form a block with its own column widths, written
+ * out before the next block is measured. */
+static void print_grid(struct entry **list, size_t count, int term_width,
+                       const struct dir_ctx *dir, int across) {
+    if (count == 0) return;
+    size_t block = opts.chunk && opts.chunk < count ? opts.chunk : count;
+    size_t *len = malloc(block * 2 * sizeof(*len));
+    if (!len) { perror("malloc"); return; }
+    for (size_t start = 0; start < count; start += block) {
+        size_t n = count - start < block ? count - start : block;
+        print_block(list + start, n, term_width, dir, across, len, len + block);
+        if (opts.chunk && dir->out->fd != -1) ob_flush(dir->out);
+    }
+    free(len);
+}
+
+/* ---------- column (down-then-across) ---------- */
+void print_columns(struct entry **list, size_t count, int term_width, const struct dir_ctx *dir) {
+    print_grid(list, count, term_width, dir, 0);
+}
+
+/* ---------- horizontal (across-then-down) ---------- */
+void print_horizontal(struct entry **list, size_t count, int term_width, const struct dir_ctx *dir) {
+    print_grid(list, count, term_width, dir, 1);
+}